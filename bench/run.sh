@@ -0,0 +1,33 @@
+#!/usr/bin/env bash
+# Times every bench/*.lox under the interpreter, the JIT and, when built, its
+# ahead-of-time executable. Configure the build with -DLOX_AOT_BENCHMARKS=ON.
+#
+#   bench/run.sh <build-dir> [runs]
+set -euo pipefail
+
+build=${1:?usage: bench/run.sh <build-dir> [runs]}
+runs=${2:-3}
+bench=$(cd "$(dirname "$0")" && pwd)
+
+# Best wall time of `runs` executions, in seconds.
+best() {
+    local best=""
+    for _ in $(seq "$runs"); do
+        local start end
+        start=$(date +%s.%N)
+        "$@" >/dev/null
+        end=$(date +%s.%N)
+        best=$(echo "$start $end $best" | awk '{ t = $2 - $1; if ($3 == "" || t < $3) print t; else print $3 }')
+    done
+    printf "%.3f" "$best"
+}
+
+printf "%-10s %12s %12s %12s\n" benchmark "vm --no-jit" vm aot
+for script in "$bench"/*.lox; do
+    name=$(basename "$script" .lox)
+    aot="-"
+    if [[ -x "$build/${name}_aot" ]]; then
+        aot=$(best "$build/${name}_aot")
+    fi
+    printf "%-10s %12s %12s %12s\n" "$name" "$(best "$build/vm" --no-jit "$script")" "$(best "$build/vm" "$script")" "$aot"
+done
@@ -0,0 +1,31 @@
+#pragma once
+#include "Object.h"
+#include <cstddef>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Ahead-of-time backend: turns a compiled script into one C++ translation unit that links
+// against the runtime (lox_runtime) and runs without the interpreter's dispatch loop.
+// The unit embeds every chunk so it can rebuild the function tree at startup, and gives
+// each verified function a native body using the same ABI as the JIT (see Jit.h):
+// common opcodes are open-coded with number fast paths, everything else is handed to
+// the interpreter one instruction at a time.
+class AotEmitter {
+public:
+    // Returns the source, or nullopt if a constant has no C++ spelling.
+    static std::optional<std::string> emit(ObjFunction& script);
+
+private:
+    std::vector<ObjFunction*> functions;
+    std::unordered_map<const ObjFunction*, size_t> ids;
+    std::ostringstream out;
+
+    bool collect(ObjFunction& function);
+    void emitData(size_t id);
+    void emitBody(size_t id);
+    void emitLoader();
+    std::string constant(const Value& value) const;
+};
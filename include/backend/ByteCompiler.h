@@ -2,22 +2,47 @@
 
 #include "Chunk.h"
 #include "Expression.h"
+#include "Heap.h"
+#include "Instructions.h"
 #include "Object.h"
 #include "ScopeManager.h"
 #include "Statement.h"
 #include "Token.h"
 #include "Value.h"
 
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
+
+enum class FunctionCompilation {
+    Eager,
+    // Global function bodies compile on their first call.
+    Lazy,
+    // Global function bodies compile concurrently once the script body is done.
+    Parallel
+};
+
 class ByteCompiler {
 public:
-    ByteCompiler()
-        : hadError(false)
+    explicit ByteCompiler(const FunctionCompilation mode = FunctionCompilation::Eager)
+        : mode(mode)
+        , hadError(false)
     {
         Token mainToken = { Tokentype::IDENTIFIER, "main", 0, 0 };
-        pushFunction(mainToken);
+        pushFunction(mainToken, false);
+        Heap::instance().addRoots(this);
     }
+    // The heap knows the compiler by address.
+    ByteCompiler(const ByteCompiler&) = delete;
+    ByteCompiler& operator=(const ByteCompiler&) = delete;
+    ~ByteCompiler();
     ObjFunction* compile(std::vector<std::unique_ptr<Statement>>& stmts);
+    static bool compileDeferred(ObjFunction& stub, std::vector<const ObjFunction*>* disassemblyLog = nullptr);
+    // Reports the functions still being compiled to the collector.
+    void markRoots(Heap& heap) const;
 
 private:
     struct Upvalue {
@@ -25,12 +50,28 @@ private:
         bool isLocal;
     };
 
-    std::vector<ObjFunction*> functions;
+    struct FunctionState {
+        ObjFunction* function;
+        // The heap object holding `function`; null for the script, which the caller of compile() owns.
+        Obj* object;
+        std::vector<Upvalue> upvalues;
+        std::unordered_map<std::string, int> stringConstants;
+        // Never escapes its declaring frame: captures are read from that frame instead of upvalues.
+        bool isNonEscaping;
+    };
+
+    std::vector<FunctionState> functions;
+    std::unordered_set<const FunctionDeclaration*> nonEscapingFunctions;
     ScopeManager scopeManager;
-    std::vector<Upvalue> upvalues;
+    // Every name the script declares at top level, whether or not its declaration has been reached.
+    std::shared_ptr<const std::unordered_set<std::string>> scriptGlobals;
+    FunctionCompilation mode;
+    std::vector<ObjFunction*> deferred;
+    // When set, finished functions are queued here instead of disassembled immediately.
+    std::vector<const ObjFunction*>* disassemblyLog = nullptr;
     bool panicMode = false;
 
-    void pushFunction(const Token& name);
+    void pushFunction(const Token& name, bool isNonEscaping);
     void compile(Statement& stmt);
     void compile(Expression& expr);
 
@@ -47,8 +88,6 @@ private:
     void compileContinueStatment(const ContinueStatement& c);
     void compileFunctionDeclaration(const FunctionDeclaration& f);
 
-    Value makeFunction(ObjFunction* function);
-
     void compileSwitchStatement(const SwitchStatement& s);
 
     /* ------ Expression compilation functions ------*/
@@ -59,12 +98,16 @@ private:
     void compileAssignment(const AssignmentExpression& a);
     void compileLogical(const LogicalExpression& l);
     void compileCall(const CallExpression& c);
+    // The MATH_* opcode for a call that can only reach a math builtin, if any.
+    std::optional<OP_CODE> intrinsicFor(const CallExpression& c);
     void compilePrePostfix(const IncrementExpression& i);
     int currentLine = 0;
-    std::unordered_map<std::string, int> stringConstants;
 
     /* ------ Helper functions ------*/
     void function(const FunctionDeclaration& f);
+    void beginFunction(const FunctionDeclaration& f, bool isNonEscaping);
+    Value makeStub(const FunctionDeclaration& f);
+    void compileDeferredBodies();
     ObjFunction* endCompiler();
     void emitByte(uint8_t byte) const;
     void emitBytes(uint8_t byte1, uint8_t byte2) const;
@@ -81,8 +124,9 @@ private:
     void emitSetVariable(const ScopeManager::Variable& var);
     void beginScope();
     void endScope();
-    int resolveUpvalue(const Token& name);
-    int addUpvalue(uint8_t index, bool isLocal);
+    std::optional<ScopeManager::Variable> resolve(const Token& name);
+    int resolveUpvalue(const Token& name, size_t function);
+    int addUpvalue(size_t function, uint8_t index, bool isLocal);
     [[nodiscard]] Chunk& currentChunk() const;
     [[nodiscard]] ObjFunction* currentFunction();
     Value makeString(const std::string& s);
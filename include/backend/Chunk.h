@@ -1,9 +1,72 @@
 #pragma once
 #include "Value.h"
+#include <algorithm>
+#include <cassert>
 #include <cstddef>
+#include <cstdint>
 #include <string>
+#include <utility>
 #include <vector>
 
+struct ObjClosure;
+struct ObjNative;
+
+// Native code and the executable memory the JIT mapped for it, unmapped when this is dropped.
+// Code the JIT did not map, such as an ahead-of-time compiled function, has a size of zero.
+class MachineCode {
+public:
+    MachineCode() = default;
+    MachineCode(void* address, const size_t size)
+        : address(address)
+        , size(size)
+    {
+    }
+    MachineCode(MachineCode&& other) noexcept
+        : address(std::exchange(other.address, nullptr))
+        , size(std::exchange(other.size, 0))
+    {
+    }
+    MachineCode& operator=(MachineCode&& other) noexcept
+    {
+        if (this != &other) {
+            release();
+            address = std::exchange(other.address, nullptr);
+            size = std::exchange(other.size, 0);
+        }
+        return *this;
+    }
+    ~MachineCode() { release(); }
+
+    [[nodiscard]] void* get() const { return address; }
+    explicit operator bool() const { return address != nullptr; }
+
+private:
+    void* address = nullptr;
+    size_t size = 0;
+
+    // Defined with the JIT.
+    void release();
+};
+
+// Per-site side data: inline caches for GET_GLOBAL, SET_GLOBAL, CALL and the math builtins,
+// and the back-edge counter and trace of a LOOP.
+struct InlineCache {
+    // GET_GLOBAL/SET_GLOBAL: the global's cell, valid while `version` matches the VM's globals version.
+    uint32_t version = 0;
+    Value* cell = nullptr;
+    // CALL: the last callee seen at this site and what to invoke for it.
+    Obj* callee = nullptr;
+    ObjClosure* closure = nullptr;
+    ObjNative* native = nullptr;
+    int arity = -1;
+    // In the heap's remembered set, since `callee` may be younger than the chunk.
+    bool remembered = false;
+    // LOOP: times the back-edge was taken, and the compiled trace once it got hot.
+    uint32_t hotness = 0;
+    bool traceAborted = false;
+    MachineCode trace;
+};
+
 class Chunk {
 public:
     explicit Chunk(const int size)
@@ -23,6 +86,31 @@ public:
     std::vector<uint8_t> code;
     std::vector<Value> pool;
     std::vector<LineInfo> lines;
+    // Offsets of the instructions that have an InlineCache, in the order the compiler emitted
+    // them, which is ascending; caches[i] belongs to cacheSites[i].
+    std::vector<uint32_t> cacheSites;
+    std::vector<InlineCache> caches;
+
+    // Records that the instruction about to be written has a cache.
+    void addCacheSite() { cacheSites.push_back(static_cast<uint32_t>(code.size())); }
+
+    // The index of the site at `offset`, which must have been registered with addCacheSite.
+    [[nodiscard]] size_t siteAt(const size_t offset) const
+    {
+        const auto site = std::ranges::lower_bound(cacheSites, offset);
+        assert(site != cacheSites.end() && *site == offset && "instruction has no cache site");
+        return static_cast<size_t>(site - cacheSites.begin());
+    }
+
+    InlineCache& cacheAt(const size_t offset)
+    {
+        if (caches.size() != cacheSites.size()) {
+            allocateCaches();
+        }
+        return caches[siteAt(offset)];
+    }
+    // Sizes `caches` to the sites; the chunk must be complete, since cache addresses are kept.
+    void allocateCaches();
 
     void disassembleChunk(const std::string& name) const;
 
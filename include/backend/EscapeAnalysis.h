@@ -0,0 +1,30 @@
+#pragma once
+#include "Expression.h"
+#include "Statement.h"
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Finds local function declarations that never outlive the frame that declares them.
+// Such a function is only ever called directly from its declaring frame, so it can read
+// that frame's slots in place instead of capturing them into heap upvalues.
+class EscapeAnalysis {
+public:
+    static bool isNonEscaping(const FunctionDeclaration& f,
+        const std::vector<std::unique_ptr<Statement>>& siblings,
+        size_t declarationIndex);
+
+private:
+    explicit EscapeAnalysis(const std::string& name)
+        : name(name)
+    {
+    }
+
+    const std::string& name;
+    bool escapes = false;
+
+    void visit(const Statement& stmt, bool nested);
+    void visit(const Expression& expr, bool nested);
+    static bool declaresFunction(const Statement& stmt);
+};
@@ -1,30 +1,192 @@
 #pragma once
 #include "Chunk.h"
-#include <functional>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <span>
 #include <string>
-#include <variant>
+#include <string_view>
+#include <unordered_set>
+#include <utility>
 
-struct ObjString {
-    const std::string* str;
-    explicit ObjString(const std::string* s)
-        : str(s)
+enum class ObjType : uint8_t {
+    String,
+    Rope,
+    Function,
+    Instance,
+    Native,
+    Closure,
+};
+
+// The header every heap object starts with; the kinds below derive from it and are allocated
+// at their own size. visit() dispatches on the type tag, as std::visit would on a variant.
+class Obj {
+public:
+    ObjType type;
+    // Collector state: the mark bit, the generation and the heap's list of its generation (see Heap).
+    bool marked = false;
+    bool old = false;
+    Obj* next = nullptr;
+
+    explicit Obj(const ObjType type)
+        : type(type)
+    {
+    }
+
+    template <typename T>
+    [[nodiscard]] bool is() const { return type == T::TYPE; }
+    // Unchecked, like the static_cast it is.
+    template <typename T>
+    T& as() { return static_cast<T&>(*this); }
+    template <typename T>
+    const T& as() const { return static_cast<const T&>(*this); }
+    // Null unless the object is a T.
+    template <typename T>
+    T* asIf() { return is<T>() ? static_cast<T*>(this) : nullptr; }
+    template <typename T>
+    const T* asIf() const { return is<T>() ? static_cast<const T*>(this) : nullptr; }
+
+    template <typename F>
+    decltype(auto) visit(F&& f);
+    template <typename F>
+    decltype(auto) visit(F&& f) const;
+
+    void print() const;
+    [[nodiscard]] std::string to_string() const;
+};
+
+// FNV-1a, except that 0 becomes 1: ObjString uses 0 for a hash not yet computed.
+uint32_t hashString(std::string_view chars);
+
+// The characters, NUL-terminated, are stored right after the object; see Heap::allocateString.
+// Identifiers and other constants are interned by StringInterner::intern, so equal ones are
+// the same object. Strings made at run time are not, and are only hashed when asked to be.
+struct ObjString : Obj {
+    static constexpr ObjType TYPE = ObjType::String;
+    uint32_t length;
+    mutable uint32_t cachedHash = 0;
+
+    explicit ObjString(const uint32_t length)
+        : Obj(TYPE)
+        , length(length)
+    {
+        data()[length] = '\0';
+    }
+    ObjString(const ObjString&) = delete;
+    ObjString& operator=(const ObjString&) = delete;
+
+    [[nodiscard]] char* data() { return reinterpret_cast<char*>(this + 1); }
+    [[nodiscard]] const char* chars() const { return reinterpret_cast<const char*>(this + 1); }
+    [[nodiscard]] std::string_view view() const { return { chars(), length }; }
+    [[nodiscard]] uint32_t hash() const
+    {
+        if (cachedHash == 0) {
+            cachedHash = hashString(view());
+        }
+        return cachedHash;
+    }
+
+    // By address, which decides for two interned strings; otherwise by length, by hash where
+    // both are known, and then by the characters.
+    friend bool operator==(const ObjString& a, const ObjString& b)
+    {
+        if (&a == &b) {
+            return true;
+        }
+        if (a.length != b.length || (a.cachedHash != 0 && b.cachedHash != 0 && a.cachedHash != b.cachedHash)) {
+            return false;
+        }
+        return std::memcmp(a.chars(), b.chars(), a.length) == 0;
+    }
+};
+
+// For hash tables keyed by interned strings.
+struct ObjStringHash {
+    size_t operator()(const ObjString* s) const noexcept { return s->hash(); }
+};
+
+// A string value made by concatenating long strings: the characters of `left` followed by
+// those of `right`, each an ObjString or another ObjRope. Building a string piece by piece is
+// then linear; the characters are copied out once, when first needed, after which the rope
+// keeps only the flat ObjString, in `left`.
+//
+// Short pieces are appended into a tail buffer instead: an ObjString in `right` with room to
+// spare, of which this rope uses only the first `length - stringLength(*left)` characters.
+struct ObjRope : Obj {
+    static constexpr ObjType TYPE = ObjType::Rope;
+    uint32_t length;
+    // In the heap's remembered set (see Heap::rememberRope).
+    bool remembered = false;
+    // Set on the newest rope over a tail buffer, the only one that may write past its own
+    // characters; appending in place hands this on to the rope it makes.
+    bool ownsTail = false;
+    Obj* left;
+    // Null once flattened.
+    Obj* right;
+
+    ObjRope(Obj* left, Obj* right, const uint32_t length)
+        : Obj(TYPE)
+        , length(length)
+        , left(left)
+        , right(right)
     {
     }
+
+    // Writes the `length` characters to `out`.
+    void copyTo(char* out) const;
 };
-struct ObjFunction {
+
+// Strings and ropes are both string values.
+[[nodiscard]] inline bool isStringObj(const Obj& obj)
+{
+    return obj.is<ObjString>() || obj.is<ObjRope>();
+}
+
+[[nodiscard]] inline uint32_t stringLength(const Obj& obj)
+{
+    return obj.is<ObjString>() ? obj.as<ObjString>().length : obj.as<ObjRope>().length;
+}
+
+// Lengths are 32-bit; the VM reports a runtime error rather than make a longer string.
+inline constexpr size_t MAX_STRING_LENGTH = UINT32_MAX;
+class FunctionDeclaration;
+
+struct ObjFunction : Obj {
+    static constexpr ObjType TYPE = ObjType::Function;
     std::string name;
     int arity;
     Chunk chunk;
     size_t upValueCount;
+    // Set while the body is still uncompiled; the AST must outlive the VM run.
+    const FunctionDeclaration* declaration = nullptr;
+    // The script's global names, so the deferred body resolves builtins as an eager compile would.
+    std::shared_ptr<const std::unordered_set<std::string>> scriptGlobals;
+    // Filled in by the Verifier; verified chunks run without per-op stack checks.
+    bool isVerified = false;
+    size_t maxStackDepth = 0;
+    // Recorded by the Verifier at the parent's CLOSURE site: the parent's stack height once the
+    // closure is pushed, and its upvalue count. GET/SET_ENCLOSING_* operands must fall below them.
+    size_t enclosingSlots = 0;
+    size_t enclosingUpvalues = 0;
+    // Counted by the VM on each call; native code installed by the baseline JIT, if any.
+    uint32_t callCount = 0;
+    MachineCode jitCode;
+    // The closure it runs as when called directly; made on the first such call.
+    Obj* bareClosure = nullptr;
+    // In the heap's remembered set (see Heap::rememberFunction).
+    bool remembered = false;
     ObjFunction(std::string name, int arity, Chunk chunk)
-        : name { std::move(name) }
+        : Obj(TYPE)
+        , name { std::move(name) }
         , arity { arity }
         , chunk { std::move(chunk) }
         , upValueCount { 0 }
     {
     }
     ObjFunction()
-        : name("")
+        : Obj(TYPE)
+        , name("")
         , arity(0)
         , chunk(Chunk {})
         , upValueCount { 0 }
@@ -34,49 +196,89 @@ struct ObjFunction {
 
 struct ObjUpvalue {
     Value* location;
-    ObjUpvalue* next;
     Value closed;
+    bool marked = false;
+    bool remembered = false;
+    // Next in the heap's list of every upvalue.
+    ObjUpvalue* nextAllocated = nullptr;
+
+    explicit ObjUpvalue(Value* location)
+        : location(location)
+    {
+    }
 };
 
-class Value;
+// Natives read args[0..argCount) and write their return value to `result`, which is the
+// callee's stack slot; the VM then drops the arguments. The arity is checked before the call.
+using NativeFn = void (*)(int argCount, Value* args, Value& result);
 
-using NativeFn = std::function<Value(int argCount, Value* args)>;
+struct NativeSpec {
+    const char* name;
+    NativeFn function;
+    // -1 accepts any number of arguments.
+    int arity;
+};
 
-struct ObjNative {
+struct ObjNative : Obj {
+    static constexpr ObjType TYPE = ObjType::Native;
     NativeFn function;
-    explicit ObjNative(NativeFn fn)
-        : function(std::move(fn))
+    int arity;
+    explicit ObjNative(const NativeSpec& spec)
+        : Obj(TYPE)
+        , function(spec.function)
+        , arity(spec.arity)
     {
     }
 };
 
-struct ObjInstance {
+struct ObjInstance : Obj {
+    static constexpr ObjType TYPE = ObjType::Instance;
+    ObjInstance()
+        : Obj(TYPE)
+    {
+    }
 };
 
-struct ObjClosure {
+// The upvalues are stored right after the object, which is why closures are only made by
+// Heap::allocateClosure. They start out null and are filled in by the CLOSURE instruction.
+struct ObjClosure : Obj {
+    static constexpr ObjType TYPE = ObjType::Closure;
     ObjFunction* pFunction;
-    std::vector<ObjUpvalue*> upValues;
-    size_t size = 0;
+    std::span<ObjUpvalue*> upValues;
 
     explicit ObjClosure(ObjFunction* pFunction)
+        : Obj(TYPE)
+        , pFunction(pFunction)
+        , upValues(reinterpret_cast<ObjUpvalue**>(this + 1), pFunction->upValueCount)
     {
-        this->pFunction = pFunction;
-        upValues = {};
-        upValues.reserve(pFunction->upValueCount);
-        size = pFunction->upValueCount;
+        std::ranges::fill(upValues, nullptr);
     }
+    ObjClosure(const ObjClosure&) = delete;
+    ObjClosure& operator=(const ObjClosure&) = delete;
 };
 
-class Obj {
-public:
-    std::variant<ObjString, ObjFunction, ObjInstance, ObjNative, ObjClosure> as;
-
-    template <typename T>
-    explicit Obj(T value)
-        : as(std::move(value))
-    {
+template <typename F>
+decltype(auto) Obj::visit(F&& f)
+{
+    switch (type) {
+    case ObjType::String:
+        return f(as<ObjString>());
+    case ObjType::Rope:
+        return f(as<ObjRope>());
+    case ObjType::Function:
+        return f(as<ObjFunction>());
+    case ObjType::Instance:
+        return f(as<ObjInstance>());
+    case ObjType::Native:
+        return f(as<ObjNative>());
+    case ObjType::Closure:
+        break;
     }
+    return f(as<ObjClosure>());
+}
 
-    void print() const;
-    [[nodiscard]] std::string to_string() const;
-};
+template <typename F>
+decltype(auto) Obj::visit(F&& f) const
+{
+    return const_cast<Obj*>(this)->visit([&f](const auto& obj) -> decltype(auto) { return f(obj); });
+}
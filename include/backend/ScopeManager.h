@@ -8,12 +8,13 @@
 class ScopeManager {
 public:
     struct Variable {
-        enum class Type { Local, Upvalue, Global };
+        enum class Type { Local, Upvalue, Global, EnclosingLocal, EnclosingUpvalue };
         Token name;
         Type type;
         uint8_t index;
         bool isReadOnly;
         int depth;
+        bool isCaptured = false;
 
         // Default constructor
         Variable() : type(Type::Local), index(0), isReadOnly(false), depth(0) {}
@@ -24,6 +25,7 @@ public:
 
     struct Scope {
         std::vector<Variable> variables;
+        // Marks the outermost scope of a function body; locals below it belong to an enclosing frame.
         bool isClosure;
     };
 
@@ -36,5 +38,9 @@ public:
     void markInitialized();
     void markInitialized(Variable& variable) const;
     std::optional<Variable> resolveVariable(const Token& name);
+    Variable* resolveLocal(const Token& name, size_t functionDepth);
     bool isGlobal(const std::string& name) const;
-};
\ No newline at end of file
+
+private:
+    size_t localCount() const;
+};
@@ -1,5 +1,23 @@
 #pragma once
+#include "ByteCompiler.h"
 #include <string>
 
-void runFile(const std::string& path);
+struct RunOptions {
+    FunctionCompilation compilation = FunctionCompilation::Eager;
+    bool jit = true;
+    // Print JIT counters to stderr once the script finishes.
+    bool jitStats = false;
+    // Collect garbage on every allocation, to shake out missing roots.
+    bool gcStress = false;
+    // Off: no nursery, every collection traces the whole heap.
+    bool gcGenerational = true;
+    // Longest collector pause to aim for, in microseconds; 0 makes major collections stop the world.
+    long gcPauseBudgetUs = 1000;
+    // Print collector counters to stderr once the script finishes.
+    bool gcStats = false;
+};
+
+void runFile(const std::string& path, const RunOptions& options = {});
+// Writes `path` as a C++ translation unit for lox_runtime (see AotEmitter); false on failure.
+bool emitFile(const std::string& path, const std::string& output);
 void runRepl();
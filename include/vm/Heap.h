@@ -0,0 +1,199 @@
+#pragma once
+#include "Object.h"
+#include "Value.h"
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+class vMachine;
+class ByteCompiler;
+
+struct GcStats {
+    size_t minorCollections = 0;
+    size_t majorCollections = 0;
+    size_t objectsAllocated = 0;
+    size_t bytesAllocated = 0;
+    size_t objectsFreed = 0;
+    size_t bytesFreed = 0;
+    size_t bytesLive = 0;
+    // Pages and large objects, live or not.
+    size_t bytesReserved = 0;
+    uint64_t pauseTotalNs = 0;
+    uint64_t pauseMaxNs = 0;
+    // Bucket 0 counts pauses under 1 us, bucket i those in [2^(i-1), 2^i) us; the last is open-ended.
+    std::array<uint64_t, 16> pauseHistogram {};
+};
+
+// Generational, non-moving mark-and-sweep collector owning every Obj and ObjUpvalue made at
+// run time. Objects up to MAX_SMALL bytes live in pages of one size class each: a slot is
+// taken from the page's free list, or else by bumping its fill pointer. Larger ones are
+// allocated on their own. A minor collection runs after NURSERY_BYTES of allocation: it
+// marks from the roots and the remembered set, frees the unreached young objects and
+// promotes the rest in place. A major collection marks and sweeps everything; it runs once
+// the heap has grown by `growthFactor` since the last one. Emptied pages are recycled.
+//
+// Major collections are incremental: marking and the sweep of old space advance in steps of
+// at most the pause budget, one per BLOCK_SIZE of allocation. Marking is tri-colour with
+// an insertion barrier: while it runs, minor collections wait, the write barriers below shade
+// what they store, and the roots are scanned again before the final trace and sweep.
+//
+// Roots are whatever the registered VMs and compilers report (see vMachine::markRoots and
+// ByteCompiler::markRoots). Stores of a young object into places a minor collection does not
+// scan must go through a write barrier: closed upvalues, inline caches, promoted functions,
+// flattened ropes, and a VM's globals (which are carded, see vMachine::globalsDirty).
+class Heap {
+public:
+    static constexpr size_t BLOCK_SIZE = 32 * 1024;
+    static constexpr size_t NURSERY_BYTES = 1024 * 1024;
+    static constexpr size_t MAX_SMALL = 256;
+
+    static Heap& instance()
+    {
+        static Heap heap;
+        return heap;
+    }
+
+    template <typename T>
+    Obj* allocate(T payload)
+    {
+        static_assert(std::is_base_of_v<Obj, T> && alignof(T) <= alignof(Obj));
+        std::lock_guard lock { mutex };
+        Obj* obj = new (reserve(sizeof(T))) T(std::move(payload));
+        obj->next = young;
+        young = obj;
+        return obj;
+    }
+    ObjClosure* allocateClosure(ObjFunction* function);
+    // A string of `length` characters, at most MAX_STRING_LENGTH, for the caller to fill in; it
+    // is not interned.
+    ObjString* allocateString(size_t length);
+    // `chars` must not point into the heap, which this may collect.
+    ObjString* allocateString(std::string_view chars);
+    ObjUpvalue* allocateUpvalue(Value* slot);
+
+    // A major collection.
+    void collect();
+    void setStress(bool enabled);
+    void setGrowthFactor(double factor);
+    // Off: every collection is a major one, triggered by heap growth alone.
+    void setGenerational(bool enabled);
+    // Zero: major collections stop the world until done.
+    void setPauseBudget(std::chrono::microseconds budget);
+    GcStats stats() const;
+
+    void addRoots(vMachine* vm);
+    void removeRoots(vMachine* vm);
+    void addRoots(ByteCompiler* compiler);
+    void removeRoots(ByteCompiler* compiler);
+
+    // For root providers. During a minor collection old objects are not traced.
+    bool isMinorCollection() const { return minor; }
+    void markValue(const Value& value);
+    void markObject(Obj* obj);
+    void markUpvalue(ObjUpvalue* upvalue);
+    void markChunk(const Chunk& chunk);
+
+    // Write barriers; call after the store when needsBarrier(value).
+    static bool isYoung(const Value& value) { return value.isObj() && !value.asObj()->old; }
+    static bool needsBarrier(const Obj* obj) { return !obj->old || marking; }
+    static bool needsBarrier(const Value& value) { return value.isObj() && needsBarrier(value.asObj()); }
+    void rememberUpvalue(ObjUpvalue* upvalue);
+    void rememberCache(InlineCache& cache);
+    void rememberFunction(ObjFunction& function);
+    void rememberRope(ObjRope& rope);
+
+    // Collections wait while one of these is alive, e.g. while objects are only held in C++
+    // locals or other threads are allocating.
+    class NoCollection {
+    public:
+        NoCollection();
+        ~NoCollection();
+        NoCollection(const NoCollection&) = delete;
+        NoCollection& operator=(const NoCollection&) = delete;
+    };
+
+private:
+    // A page of equal slots. Pages are BLOCK_SIZE-aligned, so an object finds its page by
+    // masking its address. Freed slots are chained through their first word.
+    struct Block {
+        size_t slotSize;
+        size_t used;
+        size_t live;
+        void* freeSlots;
+    };
+    static constexpr size_t GRANULE = alignof(Obj);
+    static constexpr size_t SIZE_CLASSES = MAX_SMALL / GRANULE;
+    static constexpr size_t FIRST_SLOT = (sizeof(Block) + GRANULE - 1) / GRANULE * GRANULE;
+    // Small sizes round up to a multiple of GRANULE; class c holds slots of (c + 1) * GRANULE.
+    static constexpr size_t sizeClass(const size_t size) { return (size + GRANULE - 1) / GRANULE - 1; }
+    static constexpr size_t slotSize(const size_t size) { return size > MAX_SMALL ? size : (sizeClass(size) + 1) * GRANULE; }
+    class Budget;
+
+    // Static so that the barrier check is a plain load.
+    static inline bool marking = false;
+
+    mutable std::mutex mutex;
+    Obj* young = nullptr;
+    Obj* old = nullptr;
+    // Old space still to be swept after the last major collection.
+    Obj* unswept = nullptr;
+    ObjUpvalue* upvalues = nullptr;
+    ObjUpvalue* unsweptUpvalues = nullptr;
+    // Per size class, the page allocated from and those with room left.
+    std::array<Block*, SIZE_CLASSES> current {};
+    std::array<std::vector<Block*>, SIZE_CLASSES> partial;
+    std::vector<Block*> blocks;
+    std::vector<Block*> freeBlocks;
+    std::vector<Obj*> grey;
+    std::vector<ObjUpvalue*> rememberedUpvalues;
+    std::vector<InlineCache*> rememberedCaches;
+    std::vector<ObjFunction*> rememberedFunctions;
+    std::vector<ObjRope*> rememberedRopes;
+    std::vector<vMachine*> machines;
+    std::vector<ByteCompiler*> compilers;
+    // Slot bytes not yet freed, in all and in large objects.
+    size_t heapBytes = 0;
+    size_t largeBytes = 0;
+    // Slot bytes allocated since the last minor collection, and since the last step.
+    size_t youngBytes = 0;
+    size_t sinceStep = 0;
+    size_t nextMajor = NURSERY_BYTES;
+    double growthFactor = 2.0;
+    std::chrono::microseconds pauseBudget { 1000 };
+    bool generational = true;
+    bool stress = false;
+    bool minor = false;
+    bool sweeping = false;
+    int paused = 0;
+    GcStats counters;
+
+    Heap() = default;
+    // Room for an object of `size` bytes, doing collector work first if it is due.
+    void* reserve(size_t size);
+    void* takeSlot(size_t size);
+    void release(void* memory, size_t size);
+    bool collectionDue() const;
+    void step();
+    void startMajor();
+    void markRoots();
+    void collectLocked(bool full);
+    void traceReferences(Budget& budget);
+    void forgetRemembered();
+    void sweep(Obj*& list, Budget& budget);
+    void finishSweeping();
+    void sweepUpvalues(Budget& budget);
+    void recordPause(std::chrono::steady_clock::time_point start);
+    void recycleBlocks();
+    Block* takeBlock(size_t slotSize);
+    static Block* blockOf(const void* memory)
+    {
+        return reinterpret_cast<Block*>(reinterpret_cast<uintptr_t>(memory) & ~(BLOCK_SIZE - 1));
+    }
+};
@@ -1,4 +1,5 @@
 #pragma once
+#include <cstddef>
 #include <cstdint>
 
 enum class OP_CODE {
@@ -34,9 +35,24 @@ enum class OP_CODE {
     CLOSURE,
     GET_UPVALUE,
     SET_UPVALUE,
-    CLOSE_UPVALUE
+    CLOSE_UPVALUE,
+    GET_ENCLOSING_LOCAL,
+    SET_ENCLOSING_LOCAL,
+    GET_ENCLOSING_UPVALUE,
+    SET_ENCLOSING_UPVALUE,
+    // Calls to the math builtins: the callee and its arguments are on the stack as for CALL,
+    // and the builtin runs inline when the callee is still that native.
+    MATH_SQRT,
+    MATH_ABS,
+    MATH_FLOOR,
+    MATH_CEIL,
+    MATH_ROUND,
+    MATH_POW
 };
 
+// Keep in step with the last OP_CODE enumerator.
+constexpr inline size_t OP_CODE_COUNT = static_cast<size_t>(OP_CODE::MATH_POW) + 1;
+
 constexpr inline uint8_t cast(OP_CODE code)
 {
     return static_cast<uint8_t>(code);
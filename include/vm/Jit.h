@@ -0,0 +1,85 @@
+#pragma once
+#include "Value.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#if defined(VM_JIT) && defined(VM_NAN_BOXING) && defined(__x86_64__) && defined(__linux__) && !defined(DEBUG_TRACE_EXECUTION)
+#define VM_JIT_AVAILABLE
+#endif
+
+class vMachine;
+struct ObjFunction;
+struct InlineCache;
+class MachineCode;
+
+// Counters reported by --jit-stats.
+struct JitStats {
+    size_t functionsCompiled = 0;
+    size_t tracesCompiled = 0;
+    size_t tracesExecuted = 0;
+    size_t tracesAborted = 0;
+};
+
+// Baseline copy-and-patch JIT for x86-64 Linux. A hot verified function is translated
+// one bytecode at a time by copying a fixed machine-code template and patching its
+// operands (slot offsets, constant bits, jump targets). Opcodes without a template call
+// back into the interpreter for that single instruction, so every chunk can be compiled.
+// Generated code keeps the frame's slot base and the stack top in callee-saved registers.
+//
+// Loops get a second tier: once a LOOP back-edge is hot, one iteration is recorded with the
+// operand types it saw and compiled into a straight-line trace. Guards check that later
+// iterations take the same path with the same types; when one fails the trace returns the
+// bytecode address to resume at and the interpreter carries on from there.
+class Jit {
+public:
+#ifdef VM_JIT_AVAILABLE
+    static constexpr bool available = true;
+#else
+    static constexpr bool available = false;
+#endif
+    static constexpr uint32_t CALL_THRESHOLD = 1000;
+    static constexpr uint32_t LOOP_THRESHOLD = 100;
+    static constexpr size_t MAX_TRACE_LENGTH = 512;
+
+    // Installs native code for `function`; on failure it simply stays interpreted.
+    static bool compile(vMachine& vm, ObjFunction& function);
+    // Runs the compiled frame on top of the VM's frame stack until it returns.
+    static bool enter(vMachine& vm);
+    // Called on a hot back-edge with the current frame's ip at the loop header. Records and
+    // compiles a trace the first time, then runs it; false means the VM hit a runtime error.
+    static bool backEdge(vMachine& vm, InlineCache& cache);
+
+    // Native code ABI, shared with ahead-of-time compiled scripts (see AotEmitter). A
+    // function's native code is an Entry stored in ObjFunction::jitCode. The VM running it
+    // passes itself, its stack-top slot and its globals version, so one body serves every VM.
+    // It keeps its stack top in a local and syncs it through `top` around the helpers below,
+    // each of which returns false after a runtime error.
+    using Entry = bool (*)(Value* slots, vMachine* vm, Value** top, const uint32_t* globalsVersion);
+    // Runs the single instruction at `ip` in the interpreter.
+    static bool step(vMachine* vm, const uint8_t* ip);
+    static bool call(vMachine* vm, const uint8_t* ip);
+    // Runs a MATH_* instruction, including the call it makes when the builtin was replaced.
+    static bool math(vMachine* vm, const uint8_t* ip);
+    static bool ret(vMachine* vm);
+
+private:
+    // Same arguments as Entry; returns where the interpreter resumes, or nullptr after a runtime error.
+    using TraceEntry = const uint8_t* (*)(Value* slots, vMachine* vm, Value** top, const uint32_t* globalsVersion);
+
+    struct TraceStep {
+        size_t offset;
+        // Arithmetic and comparisons: both operands were numbers.
+        bool numbers = false;
+        // JUMP_IF_FALSE: the condition was truthy, so the trace falls through.
+        bool truthy = false;
+    };
+
+    // Runs one iteration through the interpreter, leaving `steps` empty if it cannot be traced.
+    static bool record(vMachine& vm, std::vector<TraceStep>& steps);
+    static MachineCode compileTrace(ObjFunction& function, const std::vector<TraceStep>& steps);
+
+    static bool isTruthy(uint64_t bits);
+
+    class Assembler;
+};
@@ -1,13 +1,52 @@
 #pragma once
-#include "unordered_set"
+#include "Object.h"
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string_view>
+#include <vector>
 
+struct InternStats {
+    size_t strings = 0;
+    size_t capacity = 0;
+    size_t tombstones = 0;
+    // Distance of the live entries from the slot their hash maps to.
+    double meanProbe = 0;
+    size_t maxProbe = 0;
+};
+
+// Maps each distinct character sequence to its one ObjString, in an open-addressing table
+// probed linearly from the string's cached hash. The strings are allocated on the Heap and
+// the entries are weak: the collector removes a string once nothing else reaches it.
 class StringInterner {
 private:
-    std::unordered_set<std::string> pool;
+    struct Entry {
+        ObjString* string = nullptr;
+        uint32_t hash = 0;
+        // A removed entry; probing continues past it.
+        bool tombstone = false;
+    };
+    static constexpr size_t MIN_CAPACITY = 64;
+
+    std::vector<Entry> entries;
+    size_t count = 0;
+    size_t tombstones = 0;
+    // Function bodies may be compiled on worker threads. Never held while allocating, since
+    // that may collect.
+    mutable std::mutex mutex;
+
+    StringInterner() = default;
+    // The index of the entry holding `chars`, or else of the slot to insert it at.
+    size_t probe(std::string_view chars, uint32_t hash) const;
+    void grow();
 
 public:
-    const std::string* intern(const std::string& s);
-    [[nodiscard]] const std::string* find(const std::string& s) const;
+    ObjString* intern(std::string_view chars);
+    [[nodiscard]] ObjString* find(std::string_view chars) const;
+    // For the collector: drop a string about to be freed, or every string left unmarked.
+    void remove(const ObjString* s);
+    void removeUnmarked();
+    InternStats stats() const;
     static StringInterner& instance()
     {
         static StringInterner interner;
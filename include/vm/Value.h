@@ -1,12 +1,77 @@
 #pragma once
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <string>
+#include <utility>
 #include <variant>
 
 class Obj;
 struct ObjFunction;
 
+// Two interchangeable layouts: with VM_NAN_BOXING a Value is a single 64-bit word holding
+// either a raw double or a quiet NaN whose payload tags nil/bool/Obj*; otherwise it is a
+// std::variant. Code outside this header goes through the is*/as* accessors or visit().
 struct Value {
+#ifdef VM_NAN_BOXING
+    static constexpr uint64_t SIGN_BIT = 0x8000000000000000;
+    static constexpr uint64_t QNAN = 0x7ffc000000000000;
+    static constexpr uint64_t TAG_NIL = 1;
+    static constexpr uint64_t TAG_FALSE = 2;
+    static constexpr uint64_t TAG_TRUE = 3;
+
+    uint64_t bits;
+
+    Value()
+        : bits(QNAN | TAG_NIL)
+    {
+    }
+
+    Value(double value)
+    {
+        std::memcpy(&bits, &value, sizeof(double));
+    }
+    Value(bool value)
+        : bits(QNAN | (value ? TAG_TRUE : TAG_FALSE))
+    {
+    }
+    Value(nullptr_t)
+        : bits(QNAN | TAG_NIL)
+    {
+    }
+    Value(Obj* obj)
+        : bits(SIGN_BIT | QNAN | reinterpret_cast<uintptr_t>(obj))
+    {
+    }
+
+    bool isNumber() const { return (bits & QNAN) != QNAN; }
+    bool isBool() const { return (bits | 1) == (QNAN | TAG_TRUE); }
+    bool isNil() const { return bits == (QNAN | TAG_NIL); }
+    bool isObj() const { return (bits & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT); }
+    bool asBool() const { return bits == (QNAN | TAG_TRUE); }
+    Obj* asObj() const { return reinterpret_cast<Obj*>(bits & ~(SIGN_BIT | QNAN)); }
+    double asNumberUnchecked() const
+    {
+        double d;
+        std::memcpy(&d, &bits, sizeof(double));
+        return d;
+    }
+
+    template <typename F>
+    decltype(auto) visit(F&& f) const
+    {
+        if (isNumber()) {
+            return f(asNumberUnchecked());
+        }
+        if (isObj()) {
+            return f(asObj());
+        }
+        if (isBool()) {
+            return f(asBool());
+        }
+        return f(nullptr);
+    }
+#else
     std::variant<double, bool, nullptr_t, Obj*> as;
 
     Value()
@@ -30,8 +95,23 @@ struct Value {
         : as(obj)
     {
     }
+
+    bool isNumber() const { return std::holds_alternative<double>(as); }
+    bool isBool() const { return std::holds_alternative<bool>(as); }
+    bool isNil() const { return std::holds_alternative<nullptr_t>(as); }
+    bool isObj() const { return std::holds_alternative<Obj*>(as); }
+    bool asBool() const { return *std::get_if<bool>(&as); }
+    Obj* asObj() const { return *std::get_if<Obj*>(&as); }
+    double asNumberUnchecked() const { return *std::get_if<double>(&as); }
+
+    template <typename F>
+    decltype(auto) visit(F&& f) const
+    {
+        return std::visit(std::forward<F>(f), as);
+    }
+#endif
+
     bool isString() const;
-    bool isNumber() const;
     double asNumber() const;
     bool isTruthy() const;
     void print() const;
@@ -51,3 +131,20 @@ struct Value {
     Value operator-(const Value& other) const;
     Value operator>(const Value& other) const;
 };
+
+#ifdef VM_NAN_BOXING
+static_assert(sizeof(Value) == 8, "NaN-boxed Value must fit in one word");
+#endif
+
+// Visits a pair of values with the alternatives of both, like std::visit over two variants.
+template <typename F>
+decltype(auto) visit(F&& f, const Value& a, const Value& b)
+{
+#ifdef VM_NAN_BOXING
+    return a.visit([&](auto x) -> decltype(auto) {
+        return b.visit([&](auto y) -> decltype(auto) { return f(x, y); });
+    });
+#else
+    return std::visit(std::forward<F>(f), a.as, b.as);
+#endif
+}
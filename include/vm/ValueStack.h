@@ -0,0 +1,46 @@
+#pragma once
+#include "Value.h"
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+// Fixed-capacity value stack. The storage never moves, so open upvalues and the
+// interpreter's cached slot pointers stay valid; push/pop do no capacity checks,
+// callers reserve headroom up front (see vMachine::call).
+class ValueStack {
+public:
+    explicit ValueStack(const size_t capacity)
+        : values(std::make_unique<Value[]>(capacity))
+        , top(values.get())
+        , limit(values.get() + capacity)
+    {
+    }
+
+    void push_back(const Value& value) { *top++ = value; }
+    template <typename... Args>
+    void emplace_back(Args&&... args) { *top++ = Value(std::forward<Args>(args)...); }
+    void pop_back() { --top; }
+    Value& back() { return top[-1]; }
+    const Value& back() const { return top[-1]; }
+
+    Value& operator[](const size_t index) { return values[index]; }
+    Value* data() { return values.get(); }
+    Value* begin() { return values.get(); }
+    Value* end() { return top; }
+    const Value* begin() const { return values.get(); }
+    const Value* end() const { return top; }
+
+    size_t size() const { return top - values.get(); }
+    size_t capacity() const { return limit - values.get(); }
+    // True when `count` more values fit.
+    bool hasRoom(const size_t count) const { return count <= static_cast<size_t>(limit - top); }
+    void resize(const size_t count) { top = values.get() + count; }
+    void clear() { top = values.get(); }
+    // Generated code keeps the top in a register and syncs it through this address.
+    Value** topAddress() { return &top; }
+
+private:
+    std::unique_ptr<Value[]> values;
+    Value* top;
+    Value* limit;
+};
@@ -0,0 +1,36 @@
+#pragma once
+#include "Object.h"
+#include <cstddef>
+#include <optional>
+#include <vector>
+
+// Abstractly interprets a function's chunk before it runs. A chunk verifies when every
+// instruction decodes, every jump lands on an instruction, every path reaches RETURN with
+// a consistent stack height, and every local slot read or written is already on the stack.
+// Nested function constants are verified along with their parent, after it, so that slots and
+// upvalues they reach in the enclosing frame are bounded by what the parent had at its CLOSURE.
+class Verifier {
+public:
+    static bool verify(ObjFunction& function);
+    // Byte length of the instruction at `offset`, or nullopt if it does not decode.
+    static std::optional<size_t> lengthAt(const ObjFunction& function, size_t offset);
+
+private:
+    explicit Verifier(const ObjFunction& function)
+        : function(function)
+        , chunk(function.chunk)
+    {
+    }
+
+    const ObjFunction& function;
+    const Chunk& chunk;
+    std::vector<int> heights;
+    std::vector<size_t> worklist;
+    size_t maxDepth = 0;
+
+    bool run();
+    std::optional<std::vector<bool>> decode() const;
+    std::optional<size_t> instructionLength(size_t offset) const;
+    ObjFunction* functionConstant(size_t index) const;
+    bool flow(size_t target, int height, const std::vector<bool>& starts);
+};
@@ -1,173 +1,153 @@
 #pragma once
+#include "Heap.h"
 #include "Object.h"
-#include "Stringinterner.h"
 #include "Value.h"
+#include <chrono>
 #include <cmath>
 #include <iostream>
 #include <random>
 #include <string>
 
-inline Value getArg(int argCount, Value* args, int index = 0)
+inline void absNative(int, Value* args, Value& result)
 {
-    if (argCount > index) {
-        return args[index];
-    }
-    return Value(); // Return null for missing arguments
+    result = args[0].isNumber() ? Value(std::abs(args[0].asNumber())) : Value();
 }
 
-inline Value absNative(int argCount, Value* args)
+inline void powNative(int, Value* args, Value& result)
 {
-    auto v = getArg(argCount, args);
-    if (v.isNumber()) {
-        return Value(std::abs(v.asNumber()));
+    if (args[0].isNumber() && args[1].isNumber()) {
+        result = Value(std::pow(args[0].asNumber(), args[1].asNumber()));
+    } else {
+        result = Value();
     }
-    return Value();
 }
 
-inline Value powNative(int argCount, Value* args)
+inline void sqrtNative(int, Value* args, Value& result)
 {
-    auto base = getArg(argCount, args, 0);
-    auto exponent = getArg(argCount, args, 1);
-    if (base.isNumber() && exponent.isNumber()) {
-        return Value(std::pow(base.asNumber(), exponent.asNumber()));
+    if (args[0].isNumber() && args[0].asNumber() >= 0) {
+        result = Value(std::sqrt(args[0].asNumber()));
+    } else {
+        result = Value();
     }
-    return Value();
 }
 
-inline Value sqrtNative(int argCount, Value* args)
+inline void floorNative(int, Value* args, Value& result)
 {
-    auto v = getArg(argCount, args);
-    if (v.isNumber() && v.asNumber() >= 0) {
-        return Value(std::sqrt(v.asNumber()));
-    }
-    return Value();
+    result = args[0].isNumber() ? Value(std::floor(args[0].asNumber())) : Value();
 }
 
-inline Value floorNative(int argCount, Value* args)
+inline void ceilNative(int, Value* args, Value& result)
 {
-    auto v = getArg(argCount, args);
-    if (v.isNumber()) {
-        return Value(std::floor(v.asNumber()));
-    }
-    return Value();
+    result = args[0].isNumber() ? Value(std::ceil(args[0].asNumber())) : Value();
 }
 
-inline Value ceilNative(int argCount, Value* args)
+inline void roundNative(int, Value* args, Value& result)
 {
-    auto v = getArg(argCount, args);
-    if (v.isNumber()) {
-        return Value(std::ceil(v.asNumber()));
-    }
-    return Value();
+    result = args[0].isNumber() ? Value(std::round(args[0].asNumber())) : Value();
 }
 
-inline Value roundNative(int argCount, Value* args)
-{
-    auto v = getArg(argCount, args);
-    if (v.isNumber()) {
-        return Value(std::round(v.asNumber()));
-    }
-    return Value();
-}
-
-inline Value randomNative(int argCount, Value* args)
+inline void randomNative(int, Value*, Value& result)
 {
     static std::random_device rd;
     static std::mt19937 gen(rd());
     static std::uniform_real_distribution<> dis(0, 1);
-    return Value(dis(gen));
+    result = Value(dis(gen));
 }
 
-inline Value isNumberNative(int argCount, Value* args)
+inline void isNumberNative(int, Value* args, Value& result)
 {
-    auto v = getArg(argCount, args);
-    return Value(v.isNumber());
+    result = Value(args[0].isNumber());
 }
 
-inline Value isStringNative(int argCount, Value* args)
+inline void isStringNative(int, Value* args, Value& result)
 {
-    auto v = getArg(argCount, args);
-    return Value(v.isString());
+    result = Value(args[0].isString());
 }
 
-inline Value isNullNative(int argCount, Value* args)
+inline void isNullNative(int, Value* args, Value& result)
 {
-    auto v = getArg(argCount, args);
-    return Value(std::holds_alternative<nullptr_t>(v.as));
+    result = Value(args[0].isNil());
 }
 
-inline Value isBoolNative(int argCount, Value* args)
+inline void isBoolNative(int, Value* args, Value& result)
 {
-    auto v = getArg(argCount, args);
-    return Value(std::holds_alternative<bool>(v.as));
+    result = Value(args[0].isBool());
 }
 
-inline Value toNumberNative(int argCount, Value* args)
+inline void toNumberNative(int, Value* args, Value& result)
 {
-    auto v = getArg(argCount, args);
+    const Value v = args[0];
+    result = Value();
     if (v.isNumber()) {
-        return v;
+        result = v;
     } else if (v.isString()) {
         try {
-            return Value(std::stod(v.to_string()));
+            result = Value(std::stod(v.to_string()));
         } catch (...) {
             // Handle conversion error
         }
     }
-    return Value();
 }
 
-inline Value toStringNative(int argCount, Value* args)
+inline void toStringNative(int, Value* args, Value& result)
 {
-    auto v = getArg(argCount, args);
-    const std::string* internedStr = StringInterner::instance().intern(v.to_string());
-    return Value(new Obj(ObjString(internedStr)));
+    result = Value(Heap::instance().allocateString(args[0].to_string()));
 }
 
-inline Value toBooleanNative(int argCount, Value* args)
+inline void toBooleanNative(int, Value* args, Value& result)
 {
-    auto v = getArg(argCount, args);
-    return Value(v.isTruthy());
+    result = Value(args[0].isTruthy());
 }
 
-inline Value printNative(int argCount, Value* args)
+inline void printNative(int argCount, Value* args, Value& result)
 {
     for (int i = 0; i < argCount; i++) {
         args[i].print();
         std::cout << " ";
     }
     std::cout << std::endl;
-    return Value();
+    result = Value();
 }
 
-inline Value inputNative(int argCount, Value* args)
+inline void inputNative(int, Value*, Value& result)
 {
     std::string line;
     std::getline(std::cin, line);
-    const std::string* internedStr = StringInterner::instance().intern(line);
-    return Value(new Obj(ObjString(internedStr)));
+    result = line.size() <= MAX_STRING_LENGTH ? Value(Heap::instance().allocateString(line)) : Value();
 }
 
-inline Value lengthNative(int argCount, Value* args)
+inline void lengthNative(int, Value* args, Value& result)
 {
-    auto v = getArg(argCount, args);
-    if (v.isString()) {
-        return Value(static_cast<double>(v.to_string().length()));
-    }
-    return Value(0.0);
+    result = Value(args[0].isString() ? static_cast<double>(stringLength(*args[0].asObj())) : 0.0);
 }
 
-inline Value clockNative(int argCount, Value* args)
+inline void clockNative(int, Value*, Value& result)
 {
-    if (argCount != 0) {
-        return Value(-1.0); // Example error return
-    }
-
     auto now = std::chrono::system_clock::now();
     auto duration = now.time_since_epoch();
     auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(duration);
 
-    double seconds = static_cast<double>(nanoseconds.count()) / 1'000'000'000.0;
-
-    return Value(seconds);
-}
+    result = Value(static_cast<double>(nanoseconds.count()) / 1'000'000'000.0);
+}
+
+// The standard library, registered as globals by vMachine::load.
+inline constexpr NativeSpec nativeTable[] = {
+    // name, function, arity
+    { "abs", absNative, 1 },
+    { "pow", powNative, 2 },
+    { "sqrt", sqrtNative, 1 },
+    { "floor", floorNative, 1 },
+    { "ceil", ceilNative, 1 },
+    { "round", roundNative, 1 },
+    { "random", randomNative, 0 },
+    { "isNumber", isNumberNative, 1 },
+    { "isString", isStringNative, 1 },
+    { "isNull", isNullNative, 1 },
+    { "isBool", isBoolNative, 1 },
+    { "toNumber", toNumberNative, 1 },
+    { "toBoolean", toBooleanNative, 1 },
+    { "printNative", printNative, -1 },
+    { "input", inputNative, 0 },
+    { "length", lengthNative, 1 },
+    { "clock", clockNative, 0 },
+};
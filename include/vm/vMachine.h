@@ -1,109 +1,143 @@
 #pragma once
 #include "Chunk.h"
+#include "Heap.h"
+#include "Instructions.h"
+#include "Jit.h"
 #include "Object.h"
+#include "ValueStack.h"
 #include "stdlibfuncs.h"
 #include <cstddef>
 #include <cstdint>
 #include <unordered_map>
+#include <vector>
 enum class vState { OK,
     BAD };
 
+// Why the last run stopped with vState::BAD.
+enum class vError { None,
+    TypeError,
+    DivisionByZero,
+    UndefinedVariable,
+    Redefinition,
+    InvalidLocal,
+    ArityMismatch,
+    StackOverflow,
+    StackUnderflow,
+    NotCallable,
+    UnknownOpcode,
+    CompileError };
+
+// Every frame runs a closure; bare functions are wrapped before they are called.
 struct CallFrame {
-    ObjFunction*
-        function;
-    size_t ip;
-    size_t stackOffset;
     ObjClosure* closure;
+    // Only current while the frame is suspended; the interpreter loop keeps the live copy in a local.
+    const uint8_t* ip;
+    size_t stackOffset;
 };
 
 class vMachine {
+    friend class Jit;
+
 public:
     std::vector<CallFrame> frames;
-    void call(ObjFunction* function, int argCount);
-    void call(ObjClosure* closure, int argCount);
-    bool callValue(Value callee, int argCount);
+    bool call(ObjClosure* closure, int argCount);
+    bool callValue(Value callee, int argCount, InlineCache& cache);
 
     void closeUpvalues(Value* last);
+    // Stores through an upvalue, with the collector's write barrier.
+    void setUpvalue(ObjUpvalue* upvalue, const Value& value);
 
     ObjUpvalue* captureUpvalue(Value* local);
 
-    ObjUpvalue* openUpvalues;
+    // Ordered by the stack slot they point to, so the running frame's are at the end: capturing
+    // searches only those, and a frame that captured nothing returns after checking the last.
+    std::vector<ObjUpvalue*> openUpvalues;
     explicit vMachine()
         : globals {}
-        , stack {}
+        , stack { STACK_MAX }
     {
-
-        openUpvalues = nullptr;
+        // The interpreter loop holds a pointer to the current frame across calls.
+        frames.reserve(FRAMES_MAX);
+        Heap::instance().addRoots(this);
     }
 
-    vMachine(vMachine&&) = default;
-    vMachine(const vMachine&) = default;
-    vMachine& operator=(vMachine&&) = default;
-    vMachine& operator=(const vMachine&) = default;
-    ~vMachine() = default;
-    Value readConstant();
-    Value readConstantLong();
-    std::unordered_map<std::string, Value> globals;
-    template <typename... Args>
-    void runtimeError(const std::string& error);
+    // The heap knows the VM by address.
+    vMachine(vMachine&&) = delete;
+    vMachine(const vMachine&) = delete;
+    vMachine& operator=(vMachine&&) = delete;
+    vMachine& operator=(const vMachine&) = delete;
+    ~vMachine();
+    // Keyed by interned name.
+    std::unordered_map<ObjString*, Value, ObjStringHash> globals;
+    // Renewed whenever a global is added; GET_GLOBAL caches are only trusted for the version they saw.
+    // Inline caches live on chunks, which VMs share, so versions are never reused across VMs.
+    uint32_t globalsVersion = newGlobalsVersion();
+    static uint32_t newGlobalsVersion();
+    // Write barrier card for the globals: set when a young object is stored in one.
+    bool globalsDirty = false;
     vState getState() const
     {
         return this->state;
     }
+    vError getError() const
+    {
+        return this->error;
+    }
+    const JitStats& getJitStats() const
+    {
+        return jitStats;
+    }
     void run();
     void execute();
+    // The baseline JIT is on by default where it is available.
+    void setJitEnabled(bool enabled);
     void load(ObjFunction* mainFunction);
-    void defineNative(const std::string& name, NativeFn function);
+    // Embedding API: registers one more native as a global.
+    void defineNative(const NativeSpec& native);
+    // Reports the stack, frames, globals, open upvalues and script to the collector.
+    void markRoots(Heap& heap);
 
 private:
-    void defineNativeFunctions()
-    {
-        this->defineNative("abs", absNative);
-        this->defineNative("pow", powNative);
-        this->defineNative("sqrt", sqrtNative);
-        this->defineNative("floor", floorNative);
-        this->defineNative("ceil", ceilNative);
-        this->defineNative("round", roundNative);
-        this->defineNative("random", randomNative);
-        this->defineNative("isNumber", isNumberNative);
-        this->defineNative("isString", isStringNative);
-        this->defineNative("isNull", isNullNative);
-        this->defineNative("isBool", isBoolNative);
-        this->defineNative("toNumber", toNumberNative);
-        this->defineNative("toBoolean", toBooleanNative);
-        this->defineNative("printNative", printNative);
-        this->defineNative("input", inputNative);
-        this->defineNative("length", lengthNative);
-        this->defineNative("clock", clockNative);
-    }
+    void defineNativeFunctions();
     vState state
         = vState::OK;
+    vError error = vError::None;
+    // RETURN hands control back once the frame count drops to this; nested runs raise it.
+    size_t returnDepth = 0;
+    // The function load() was given; its constants, and through them every function, stay live.
+    ObjFunction* script = nullptr;
+    bool jitEnabled = Jit::available;
+    JitStats jitStats;
     static constexpr size_t FRAMES_MAX = 64;
     static constexpr size_t STACK_MAX = FRAMES_MAX * 256;
-    int16_t readShort();
-    std::vector<Value> stack;
+    ValueStack stack;
     void swap();
     void dup();
-    void add();
-    void mult();
-    void div();
-    void neg();
-    void logicalAnd();
-    void logicalOr();
+    // Slow paths for operands that are not both numbers; false after reporting an error.
+    bool add();
+    bool mult();
+    bool div();
+    bool neg();
+    bool operandError(const char* message);
     void logicalNot();
     void resetStack();
-    void greater();
     void equal();
-    void less();
-    void greaterEqual();
-    void lessEqual();
-    size_t& ip();
-    uint8_t readByte();
+    const uint8_t*& ip();
     Chunk& instructions() const;
+    ObjFunction* currentFunction() const;
+    void traceInstruction();
+    template <bool Verified, bool SingleStep = false>
+    bool interpret();
+    bool step(const uint8_t* ip);
 
-    void runtimeError(const std::string& error);
+    void runtimeError(vError code, const std::string& message);
 
-    size_t offset();
-    void ensureStackSize(size_t size, const char* opcode) const;
-    CallFrame& frame();
+    bool ensureCompiled(ObjFunction& function);
+    bool pushFrame(ObjClosure* closure, int argCount);
+    bool callCached(Value callee, int argCount, InlineCache& cache);
+    void popFrame();
+    // Runs the frame just pushed by a call until it returns, leaving its result on the stack.
+    bool runCallee();
+    bool callNative(ObjNative& native, int argCount);
+    static bool intrinsic(OP_CODE op, Value* args);
 };
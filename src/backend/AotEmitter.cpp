@@ -0,0 +1,359 @@
+#include "AotEmitter.h"
+#include "Instructions.h"
+#include "Verifier.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <set>
+#include <variant>
+
+namespace {
+
+std::string quote(const std::string_view s)
+{
+    std::string quoted = "\"";
+    for (const char c : s) {
+        const auto byte = static_cast<unsigned char>(c);
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += c;
+        } else if (byte < 0x20 || byte >= 0x7f) {
+            // Octal escapes stop after three digits, so a following digit cannot extend them.
+            quoted += std::format("\\{:03o}", byte);
+        } else {
+            quoted += c;
+        }
+    }
+    return quoted + "\"";
+}
+
+// Layout-affecting build flags; the generated unit must see the same ones as the runtime.
+constexpr const char* flags[] = {
+#ifdef VM_NAN_BOXING
+    "VM_NAN_BOXING",
+#endif
+#ifdef VM_JIT
+    "VM_JIT",
+#endif
+#ifdef DEBUG_TRACE_EXECUTION
+    "DEBUG_TRACE_EXECUTION",
+#endif
+};
+
+}
+
+std::optional<std::string> AotEmitter::emit(ObjFunction& script)
+{
+    AotEmitter emitter;
+    if (!emitter.collect(script)) {
+        return std::nullopt;
+    }
+    Verifier::verify(script);
+
+    auto& out = emitter.out;
+    out << "// Generated by `vm --emit-cpp`; link against lox_runtime.\n";
+    for (const char* flag : flags) {
+        out << std::format("#ifndef {0}\n#define {0}\n#endif\n", flag);
+    }
+    out << "#include \"Heap.h\"\n"
+           "#include \"Jit.h\"\n"
+           "#include \"Object.h\"\n"
+           "#include \"Stringinterner.h\"\n"
+           "#include \"Verifier.h\"\n"
+           "#include \"vMachine.h\"\n"
+           "#include <bit>\n"
+           "#include <cstdint>\n"
+           "#include <iterator>\n"
+           "#include <string>\n"
+           "#include <variant>\n\n"
+           "static ObjFunction* functions["
+        << emitter.functions.size() << "];\n";
+    // Only what the script uses is emitted, so the unit builds warning-free.
+    if (emitter.functions.size() > 1) {
+        out << "static Obj* functionObjects[" << emitter.functions.size() << "];\n";
+    }
+    const bool hasStrings = std::ranges::any_of(emitter.functions, [](const ObjFunction* function) {
+        return std::ranges::any_of(function->chunk.pool, [](const Value& value) {
+            return value.isObj() && value.asObj()->is<ObjString>();
+        });
+    });
+    if (hasStrings) {
+        out << "\nstatic Value str(const char* chars, const size_t length)\n"
+               "{\n"
+               "    return Value(StringInterner::instance().intern(std::string_view(chars, length)));\n"
+               "}\n";
+    }
+    // Only native bodies test conditions.
+    const bool hasConditions = std::ranges::any_of(emitter.functions, [](const ObjFunction* function) {
+        if (!function->isVerified) {
+            return false;
+        }
+        const auto& code = function->chunk.code;
+        for (size_t offset = 0; offset < code.size(); offset += *Verifier::lengthAt(*function, offset)) {
+            if (cast(code[offset]) == OP_CODE::JUMP_IF_FALSE) {
+                return true;
+            }
+        }
+        return false;
+    });
+    if (hasConditions) {
+        out << "\nstatic bool truthy(const Value& value)\n"
+               "{\n"
+               "    return value.isBool() ? value.asBool() : value.isTruthy();\n"
+               "}\n";
+    }
+
+    for (size_t id = 0; id < emitter.functions.size(); id++) {
+        emitter.emitData(id);
+    }
+    for (size_t id = 0; id < emitter.functions.size(); id++) {
+        if (emitter.functions[id]->isVerified) {
+            emitter.emitBody(id);
+        }
+    }
+    emitter.emitLoader();
+    out << "\nint main()\n"
+           "{\n"
+           "    vMachine machine;\n"
+           "    machine.load(load());\n"
+           "    machine.run();\n"
+           "    return machine.getState() == vState::OK ? 0 : 70;\n"
+           "}\n";
+    return out.str();
+}
+
+bool AotEmitter::collect(ObjFunction& function)
+{
+    // Lazily compiled bodies have no bytecode to translate yet.
+    if (function.declaration != nullptr) {
+        return false;
+    }
+    ids.emplace(&function, functions.size());
+    functions.push_back(&function);
+    for (const Value& value : function.chunk.pool) {
+        if (!value.isObj()) {
+            continue;
+        }
+        Obj* obj = value.asObj();
+        if (auto* nested = obj->asIf<ObjFunction>()) {
+            if (!collect(*nested)) {
+                return false;
+            }
+        } else if (!obj->is<ObjString>()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string AotEmitter::constant(const Value& value) const
+{
+    if (value.isNumber()) {
+        const double number = value.asNumberUnchecked();
+        uint64_t bits;
+        std::memcpy(&bits, &number, sizeof(bits));
+        return std::format("Value(std::bit_cast<double>(UINT64_C({:#x})))", bits);
+    }
+    if (value.isBool()) {
+        return value.asBool() ? "Value(true)" : "Value(false)";
+    }
+    if (value.isNil()) {
+        return "Value()";
+    }
+    const Obj* obj = value.asObj();
+    if (const auto* s = obj->asIf<ObjString>()) {
+        return std::format("str({}, {})", quote(s->view()), s->length);
+    }
+    return std::format("Value(functionObjects[{}])", ids.at(&obj->as<ObjFunction>()));
+}
+
+void AotEmitter::emitData(const size_t id)
+{
+    const Chunk& chunk = functions[id]->chunk;
+    out << std::format("\n// {}\nstatic const uint8_t bytecode{}[] = {{", functions[id]->name, id);
+    for (size_t i = 0; i < chunk.code.size(); i++) {
+        out << (i % 16 == 0 ? "\n    " : " ") << static_cast<int>(chunk.code[i]) << ",";
+    }
+    out << std::format("\n}};\nstatic const Chunk::LineInfo lines{}[] = {{", id);
+    for (size_t i = 0; i < chunk.lines.size(); i++) {
+        out << (i % 8 == 0 ? "\n    " : " ") << std::format("{{ {}, {} }},", chunk.lines[i].offset, chunk.lines[i].lineNumber);
+    }
+    // The interpreter only accepts instruction pointers into the live chunk, so these are set by load().
+    out << std::format("\n}};\nstatic const uint8_t* code{0};\nstatic const Value* k{0};\nstatic InlineCache* ic{0};\n", id);
+}
+
+void AotEmitter::emitBody(const size_t id)
+{
+    const ObjFunction& function = *functions[id];
+    const auto& code = function.chunk.code;
+
+    std::set<size_t> targets;
+    // Parameters the body never reads are left unnamed.
+    bool usesSlots = false;
+    bool usesGlobals = false;
+    for (size_t offset = 0; offset < code.size(); offset += *Verifier::lengthAt(function, offset)) {
+        const OP_CODE op = cast(code[offset]);
+        usesSlots |= op == OP_CODE::GET_LOCAL || op == OP_CODE::SET_LOCAL;
+        usesGlobals |= op == OP_CODE::GET_GLOBAL || op == OP_CODE::SET_GLOBAL;
+        if (op == OP_CODE::JUMP || op == OP_CODE::JUMP_IF_FALSE) {
+            targets.insert(offset + 3 + static_cast<int16_t>((code[offset + 1] << 8) | code[offset + 2]));
+        } else if (op == OP_CODE::LOOP) {
+            targets.insert(offset + 3 - ((code[offset + 1] << 8) | code[offset + 2]));
+        }
+    }
+
+    out << std::format("\nstatic bool function{}(Value*{}, vMachine* vm, Value** top, const uint32_t*{})\n{{\n    Value* sp = *top;\n",
+        id, usesSlots ? " slots" : "", usesGlobals ? " globalsVersion" : "");
+    for (size_t offset = 0; offset < code.size(); offset += *Verifier::lengthAt(function, offset)) {
+        if (targets.contains(offset)) {
+            out << std::format("L{}:\n", offset);
+        }
+        const uint8_t operand = offset + 1 < code.size() ? code[offset + 1] : 0;
+        // The instruction's cache, for GET_GLOBAL and SET_GLOBAL.
+        const auto cache = [&] {
+            return std::format("ic{}[{}]", id, function.chunk.siteAt(offset));
+        };
+        const auto step = [&](const std::string& indent) {
+            return std::format("{0}*top = sp;\n{0}if (!Jit::step(vm, code{1} + {2})) {{\n{0}    return false;\n{0}}}\n{0}sp = *top;\n",
+                indent, id, offset);
+        };
+        // Runs `action` inline when `condition` holds, otherwise the interpreter's handler.
+        const auto fastPath = [&](const std::string& condition, const std::string& action, const bool binary) {
+            out << std::format("    if ({}) {{\n        {};\n{}    }} else {{\n{}    }}\n", condition, action,
+                binary ? "        --sp;\n" : "", step("        "));
+        };
+        const auto arithmetic = [&](const char* op, const std::string& extra = "") {
+            fastPath("sp[-2].isNumber() && sp[-1].isNumber()" + extra,
+                std::format("sp[-2] = Value(sp[-2].asNumberUnchecked() {} sp[-1].asNumberUnchecked())", op), true);
+        };
+        switch (cast(code[offset])) {
+        case OP_CODE::GET_LOCAL:
+            out << std::format("    *sp++ = slots[{}];\n", operand);
+            break;
+        case OP_CODE::SET_LOCAL:
+            out << std::format("    slots[{}] = sp[-1];\n", operand);
+            break;
+        case OP_CODE::CONSTANT:
+            out << std::format("    *sp++ = k{}[{}];\n", id, operand);
+            break;
+        case OP_CODE::CONSTANT_LONG:
+            out << std::format("    *sp++ = k{}[{}];\n", id, operand | (code[offset + 2] << 8) | (code[offset + 3] << 16));
+            break;
+        case OP_CODE::NIL:
+            out << "    *sp++ = Value();\n";
+            break;
+        case OP_CODE::TRUE:
+            out << "    *sp++ = Value(true);\n";
+            break;
+        case OP_CODE::FALSE:
+            out << "    *sp++ = Value(false);\n";
+            break;
+        case OP_CODE::POP:
+            out << "    --sp;\n";
+            break;
+        case OP_CODE::ADD:
+            arithmetic("+");
+            break;
+        case OP_CODE::MULT:
+            arithmetic("*");
+            break;
+        case OP_CODE::DIV:
+            arithmetic("/", " && sp[-1].asNumberUnchecked() != 0");
+            break;
+        case OP_CODE::GREATER:
+            arithmetic(">");
+            break;
+        case OP_CODE::GREATER_EQUAL:
+            arithmetic(">=");
+            break;
+        case OP_CODE::LESS:
+            arithmetic("<");
+            break;
+        case OP_CODE::LESS_EQUAL:
+            arithmetic("<=");
+            break;
+        case OP_CODE::EQUAL:
+            arithmetic("==");
+            break;
+        case OP_CODE::NEG:
+            fastPath("sp[-1].isNumber()", "sp[-1] = Value(-sp[-1].asNumberUnchecked())", false);
+            break;
+        case OP_CODE::GET_GLOBAL:
+            fastPath(std::format("{}.version == *globalsVersion", cache()), std::format("*sp++ = *{}.cell", cache()), false);
+            break;
+        case OP_CODE::SET_GLOBAL:
+            // Objects go through the interpreter for the collector's write barrier.
+            fastPath(std::format("{}.version == *globalsVersion && !sp[-1].isObj()", cache()), std::format("*{}.cell = sp[-1]", cache()), false);
+            break;
+        case OP_CODE::JUMP:
+            out << std::format("    goto L{};\n", offset + 3 + static_cast<int16_t>((operand << 8) | code[offset + 2]));
+            break;
+        case OP_CODE::LOOP:
+            out << std::format("    goto L{};\n", offset + 3 - ((operand << 8) | code[offset + 2]));
+            break;
+        case OP_CODE::JUMP_IF_FALSE:
+            out << std::format("    if (!truthy(sp[-1])) {{\n        goto L{};\n    }}\n",
+                offset + 3 + static_cast<int16_t>((operand << 8) | code[offset + 2]));
+            break;
+        case OP_CODE::CALL:
+            out << std::format("    *top = sp;\n    if (!Jit::call(vm, code{} + {})) {{\n        return false;\n    }}\n    sp = *top;\n", id, offset);
+            break;
+        case OP_CODE::MATH_SQRT:
+        case OP_CODE::MATH_ABS:
+        case OP_CODE::MATH_FLOOR:
+        case OP_CODE::MATH_CEIL:
+        case OP_CODE::MATH_ROUND:
+        case OP_CODE::MATH_POW:
+            out << std::format("    *top = sp;\n    if (!Jit::math(vm, code{} + {})) {{\n        return false;\n    }}\n    sp = *top;\n", id, offset);
+            break;
+        case OP_CODE::RETURN:
+            out << "    *top = sp;\n    return Jit::ret(vm);\n";
+            break;
+        default:
+            out << step("    ");
+            break;
+        }
+    }
+    out << "}\n";
+}
+
+void AotEmitter::emitLoader()
+{
+    // Until machine.load() roots the script, these objects are only held by the statics.
+    out << "\nstatic ObjFunction* load()\n{\n    const Heap::NoCollection pause;\n";
+    out << std::format("    functions[0] = new ObjFunction({}, 0, Chunk {{}});\n", quote(functions[0]->name));
+    for (size_t id = 1; id < functions.size(); id++) {
+        out << std::format("    functionObjects[{0}] = Heap::instance().allocate(ObjFunction({1}, {2}, Chunk {{}}));\n"
+                           "    functions[{0}] = &functionObjects[{0}]->as<ObjFunction>();\n",
+            id, quote(functions[id]->name), functions[id]->arity);
+    }
+    for (size_t id = 0; id < functions.size(); id++) {
+        const ObjFunction& function = *functions[id];
+        out << std::format("    {{\n        ObjFunction& f = *functions[{0}];\n"
+                           "        f.upValueCount = {1};\n"
+                           "        f.chunk.code.assign(std::begin(bytecode{0}), std::end(bytecode{0}));\n"
+                           "        f.chunk.lines.assign(std::begin(lines{0}), std::end(lines{0}));\n",
+            id, function.upValueCount);
+        for (const Value& value : function.chunk.pool) {
+            out << "        f.chunk.pool.push_back(" << constant(value) << ");\n";
+        }
+        out << "        f.chunk.cacheSites = {";
+        for (const uint32_t site : function.chunk.cacheSites) {
+            out << " " << site << ",";
+        }
+        out << std::format(" }};\n"
+                           "        code{0} = f.chunk.code.data();\n"
+                           "        k{0} = f.chunk.pool.data();\n"
+                           "        f.chunk.allocateCaches();\n"
+                           "        ic{0} = f.chunk.caches.data();\n    }}\n",
+            id);
+    }
+    out << "    Verifier::verify(*functions[0]);\n";
+    for (size_t id = 0; id < functions.size(); id++) {
+        if (functions[id]->isVerified) {
+            out << std::format("    if (functions[{0}]->isVerified) {{\n        functions[{0}]->jitCode = MachineCode(reinterpret_cast<void*>(&function{0}), 0);\n    }}\n", id);
+        }
+    }
+    out << "    return functions[0];\n}\n";
+}
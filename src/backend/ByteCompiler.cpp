@@ -1,6 +1,8 @@
 #include "ByteCompiler.h"
 #include "Chunk.h"
+#include "EscapeAnalysis.h"
 #include "Expression.h"
+#include "Heap.h"
 #include "Instructions.h"
 #include "Object.h"
 #include "ScopeManager.h"
@@ -8,25 +10,72 @@
 #include "Stringinterner.h"
 #include "Token.h"
 #include "Visit.h"
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
+#include <format>
 #include <iostream>
 #include <memory>
 #include <optional>
 #include <stdexcept>
-#define DEBUG_PRINT_CODE
+#include <thread>
 
-void ByteCompiler::pushFunction(const Token& name)
+ByteCompiler::~ByteCompiler()
 {
-    const auto fun = new ObjFunction { name.lexeme, 0, {} };
-    functions.push_back(fun);
+    Heap::instance().removeRoots(this);
+    // A script function compile() never handed out.
+    for (const FunctionState& state : functions) {
+        if (state.object == nullptr) {
+            delete state.function;
+        }
+    }
+}
+
+void ByteCompiler::markRoots(Heap& heap) const
+{
+    // The chunks are scanned even when their function is old: they are still being written.
+    for (const FunctionState& state : functions) {
+        heap.markObject(state.object);
+        heap.markChunk(state.function->chunk);
+    }
+}
+
+void ByteCompiler::pushFunction(const Token& name, const bool isNonEscaping)
+{
+    if (functions.empty()) {
+        functions.push_back(FunctionState { new ObjFunction { name.lexeme, 0, {} }, nullptr, {}, {}, isNonEscaping });
+        return;
+    }
+    Obj* object = Heap::instance().allocate(ObjFunction { name.lexeme, 0, {} });
+    functions.push_back(FunctionState { &object->as<ObjFunction>(), object, {}, {}, isNonEscaping });
 }
 
 ObjFunction* ByteCompiler::compile(std::vector<std::unique_ptr<Statement>>& stmts)
 {
+    auto names = std::make_shared<std::unordered_set<std::string>>();
+    for (const auto& stmt : stmts) {
+        if (const auto* v = std::get_if<VariableDeclaration>(&stmt->as)) {
+            names->insert(v->name.lexeme);
+        } else if (const auto* f = std::get_if<FunctionDeclaration>(&stmt->as)) {
+            names->insert(f->name.lexeme);
+        }
+    }
+    scriptGlobals = std::move(names);
+
+    std::vector<const ObjFunction*> scriptLog;
+    if (mode == FunctionCompilation::Parallel) {
+        disassemblyLog = &scriptLog;
+    }
+
     for (auto& stmt : stmts) {
         compile(*stmt);
     }
 
+    if (mode == FunctionCompilation::Parallel) {
+        compileDeferredBodies();
+        disassemblyLog = nullptr;
+    }
+
     emitReturn();
     ObjFunction* function = endCompiler();
 
@@ -35,6 +84,8 @@ ObjFunction* ByteCompiler::compile(std::vector<std::unique_ptr<Statement>>& stmt
 
 void ByteCompiler::compile(Statement& stmt)
 {
+    const int enclosingLine = currentLine;
+    currentLine = stmt.line;
     std::visit(overloaded {
                    [this](const ExpressionStatement& e) -> void { compileExpressionStatement(e); },
                    [this](const PrintStatement& p) -> void { compilePrintStatment(p); },
@@ -53,12 +104,13 @@ void ByteCompiler::compile(Statement& stmt)
                    } },
         stmt.as);
 
-    currentLine = stmt.line;
+    currentLine = enclosingLine;
 }
 
 void ByteCompiler::compileExpressionStatement(const ExpressionStatement& e)
 {
     compile(*e.expression);
+    emitByte(cast(OP_CODE::POP));
 }
 
 void ByteCompiler::compilePrintStatment(const PrintStatement& p)
@@ -73,25 +125,28 @@ void ByteCompiler::compileVariableDeclaration(const VariableDeclaration& v)
     uint8_t index = 0;
     auto variable = scopeManager.declareVariable(v.name, v.isConst);
     if (variable.type == ScopeManager::Variable::Type::Global) {
-
-        if (variable.type == ScopeManager::Variable::Type::Global) {
-            index = identifierConstant(v.name);
-        }
+        index = identifierConstant(v.name);
     }
     if (v.initializer) {
         compile(*v.initializer);
     } else {
         emitByte(cast(OP_CODE::NIL));
     }
-    emitBytes(cast(OP_CODE::DEFINE_GLOBAL), index);
+    if (variable.type == ScopeManager::Variable::Type::Global) {
+        emitBytes(cast(OP_CODE::DEFINE_GLOBAL), index);
+    }
     scopeManager.markInitialized(variable);
 }
 
 void ByteCompiler::compileBlockStatement(const BlockStatement& b)
 {
     beginScope();
-    for (auto& stmt : b.statements) {
-        compile(*stmt);
+    for (size_t i = 0; i < b.statements.size(); i++) {
+        if (const auto* f = std::get_if<FunctionDeclaration>(&b.statements[i]->as);
+            f && EscapeAnalysis::isNonEscaping(*f, b.statements, i)) {
+            nonEscapingFunctions.insert(f);
+        }
+        compile(*b.statements[i]);
     }
     endScope();
 }
@@ -164,7 +219,7 @@ void ByteCompiler::compileForStatement(const ForStatement& f)
 }
 void ByteCompiler::compileReturnStatement(const ReturnStatement& r)
 {
-    if (functions.back()->name == "Main") {
+    if (functions.size() == 1) {
         errorAt(r.keyword, "Can't return from top-level code.");
     }
 
@@ -190,24 +245,97 @@ void ByteCompiler::compileContinueStatment(const ContinueStatement& c)
 void ByteCompiler::compileFunctionDeclaration(const FunctionDeclaration& f)
 {
     auto variable = scopeManager.declareVariable(f.name, false);
-    const uint8_t global = identifierConstant(f.name);
-    function(f);
+    if (mode != FunctionCompilation::Eager && variable.type == ScopeManager::Variable::Type::Global) {
+        // Globals capture nothing, so their bodies can be compiled without this scope chain.
+        const Value stub = makeStub(f);
+        if (mode == FunctionCompilation::Parallel) {
+            deferred.push_back(stub.asFunc());
+            // Marks where this body's listing belongs among the script's own.
+            disassemblyLog->push_back(stub.asFunc());
+        }
+        emitBytes(cast(OP_CODE::CLOSURE), makeConstant(stub));
+    } else {
+        function(f);
+    }
     if (variable.type == ScopeManager::Variable::Type::Global) {
-        emitBytes(cast(OP_CODE::DEFINE_GLOBAL), global);
+        emitBytes(cast(OP_CODE::DEFINE_GLOBAL), identifierConstant(f.name));
     }
 
     markInitialized(variable);
 }
-Value ByteCompiler::makeFunction(ObjFunction* function)
-{
-    function->upValueCount = upvalues.size();
-    return { new Obj(ObjFunction(*function)) };
+Value ByteCompiler::makeStub(const FunctionDeclaration& f)
+{
+    auto stub = Heap::instance().allocate(ObjFunction { f.name.lexeme, static_cast<int>(f.parameters.size()), {} });
+    stub->as<ObjFunction>().declaration = &f;
+    stub->as<ObjFunction>().scriptGlobals = scriptGlobals;
+    return { stub };
+}
+
+bool ByteCompiler::compileDeferred(ObjFunction& stub, std::vector<const ObjFunction*>* disassemblyLog)
+{
+    ByteCompiler compiler;
+    compiler.disassemblyLog = disassemblyLog;
+    compiler.scriptGlobals = stub.scriptGlobals;
+    compiler.currentLine = stub.declaration->line;
+    compiler.beginFunction(*stub.declaration, false);
+    compiler.compile(*stub.declaration->body);
+    ObjFunction* compiled = compiler.endCompiler();
+    if (compiler.hadError) {
+        return false;
+    }
+
+    stub.chunk = std::move(compiled->chunk);
+    stub.upValueCount = compiled->upValueCount;
+    stub.declaration = nullptr;
+    stub.scriptGlobals = nullptr;
+    Heap::instance().rememberFunction(stub);
+    if (disassemblyLog && !disassemblyLog->empty()) {
+        disassemblyLog->back() = &stub;
+    }
+    return true;
+}
+
+void ByteCompiler::compileDeferredBodies()
+{
+    std::vector<std::vector<const ObjFunction*>> logs(deferred.size());
+    std::vector<char> succeeded(deferred.size(), false);
+    std::atomic<size_t> next = 0;
+    // The workers' compilers are not safe to scan while they run.
+    const Heap::NoCollection pause;
+    const size_t workers = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), deferred.size());
+    {
+        std::vector<std::jthread> pool;
+        for (size_t i = 0; i < workers; i++) {
+            pool.emplace_back([&] {
+                for (size_t job = next++; job < deferred.size(); job = next++) {
+                    succeeded[job] = compileDeferred(*deferred[job], &logs[job]);
+                }
+            });
+        }
+    }
+
+    std::unordered_map<const ObjFunction*, size_t> jobs;
+    for (size_t i = 0; i < deferred.size(); i++) {
+        hadError |= !succeeded[i];
+        jobs[deferred[i]] = i;
+    }
+    // Replay the listings in source order so the output matches an eager compile.
+    for (const ObjFunction* entry : *disassemblyLog) {
+        if (const auto job = jobs.find(entry); job != jobs.end()) {
+            for (const ObjFunction* function : logs[job->second]) {
+                function->chunk.disassembleChunk(function->name);
+            }
+        } else {
+            entry->chunk.disassembleChunk(entry->name);
+        }
+    }
+    deferred.clear();
 }
 
-void ByteCompiler::function(const FunctionDeclaration& f)
+void ByteCompiler::beginFunction(const FunctionDeclaration& f, const bool isNonEscaping)
 {
-    pushFunction(f.name);
-    beginScope();
+    pushFunction(f.name, isNonEscaping);
+    scopeManager.enterScope(true);
 
     for (const auto& param : f.parameters) {
         auto variable = scopeManager.declareVariable(param, false);
@@ -215,13 +343,20 @@ void ByteCompiler::function(const FunctionDeclaration& f)
     }
 
     currentFunction()->arity = f.parameters.size();
+}
+
+void ByteCompiler::function(const FunctionDeclaration& f)
+{
+    beginFunction(f, nonEscapingFunctions.contains(&f));
     compile(*f.body);
-    const auto compiledFunction = endCompiler();
-    emitBytes(cast(OP_CODE::CLOSURE), makeConstant(makeFunction(compiledFunction)));
+    const std::vector<Upvalue> upvalues = functions.back().upvalues;
+    Obj* compiled = functions.back().object;
+    endCompiler();
+    emitBytes(cast(OP_CODE::CLOSURE), makeConstant(Value(compiled)));
 
-    for (int i = 0; i < compiledFunction->upValueCount; i++) {
-        emitByte(upvalues[i].isLocal ? 1 : 0);
-        emitByte(upvalues[i].index);
+    for (const auto& [index, isLocal] : upvalues) {
+        emitByte(isLocal ? 1 : 0);
+        emitByte(index);
     }
 }
 
@@ -260,6 +395,8 @@ void ByteCompiler::compileSwitchStatement(const SwitchStatement& s)
 
 void ByteCompiler::compile(Expression& expr)
 {
+    const int enclosingLine = currentLine;
+    currentLine = expr.line;
     std::visit(overloaded {
                    [this](const LiteralExpression& l) { compileLiteral(l); },
                    [this](const VariableExpression& v) { compileVariable(v); },
@@ -270,11 +407,11 @@ void ByteCompiler::compile(Expression& expr)
                    [this](const IncrementExpression& i) { compilePrePostfix(i); },
                    [this](const CallExpression& c) { compileCall(c); } },
         expr.as);
-    currentLine = expr.line;
+    currentLine = enclosingLine;
 }
 void ByteCompiler::compilePrePostfix(const IncrementExpression& i)
 {
-    const auto variable = scopeManager.resolveVariable(i.name);
+    const auto variable = resolve(i.name);
     if (!variable) {
         error(std::format("Undefined variable for Increment Expression {} '{}'", i.name.line, i.name.lexeme));
         return;
@@ -325,18 +462,13 @@ void ByteCompiler::compileLiteral(const LiteralExpression& l)
 }
 void ByteCompiler::compileVariable(const VariableExpression& v)
 {
-    const std::optional<ScopeManager::Variable> variable = scopeManager.resolveVariable(v.name);
+    const std::optional<ScopeManager::Variable> variable = resolve(v.name);
     if (!variable) {
         error("Undefined variable '" + v.name.lexeme + "'.");
         return;
     }
 
-    if (variable->type == ScopeManager::Variable::Type::Global) {
-        uint8_t index = identifierConstant(v.name);
-        emitBytes(cast(OP_CODE::GET_GLOBAL), index);
-    } else {
-        emitGetVariable(*variable);
-    }
+    emitGetVariable(*variable);
 }
 
 void ByteCompiler::compileUnary(const UnaryExpression& u)
@@ -423,20 +555,14 @@ void ByteCompiler::compileLogical(const LogicalExpression& l)
 }
 void ByteCompiler::compileAssignment(const AssignmentExpression& a)
 {
-    const auto variable = scopeManager.resolveVariable(a.name);
+    const auto variable = resolve(a.name);
     if (!variable) {
         error("Undefined variable '" + a.name.lexeme + "'.");
         return;
     }
 
     compile(*a.value);
-
-    if (variable->type == ScopeManager::Variable::Type::Global) {
-        uint8_t index = identifierConstant(a.name);
-        emitBytes(cast(OP_CODE::SET_GLOBAL), index);
-    } else {
-        emitSetVariable(*variable);
-    }
+    emitSetVariable(*variable);
 }
 
 void ByteCompiler::compileCall(const CallExpression& c)
@@ -445,20 +571,66 @@ void ByteCompiler::compileCall(const CallExpression& c)
     for (auto& arg : c.arguments) {
         compile(*arg);
     }
+    currentChunk().addCacheSite();
+    if (const auto intrinsic = intrinsicFor(c)) {
+        emitByte(cast(*intrinsic));
+        return;
+    }
     emitBytes(cast(OP_CODE::CALL), static_cast<uint8_t>(c.arguments.size()));
 }
 
+std::optional<OP_CODE> ByteCompiler::intrinsicFor(const CallExpression& c)
+{
+    struct Intrinsic {
+        const char* name;
+        size_t arity;
+        OP_CODE op;
+    };
+    static constexpr Intrinsic intrinsics[] = {
+        { "sqrt", 1, OP_CODE::MATH_SQRT },
+        { "abs", 1, OP_CODE::MATH_ABS },
+        { "floor", 1, OP_CODE::MATH_FLOOR },
+        { "ceil", 1, OP_CODE::MATH_CEIL },
+        { "round", 1, OP_CODE::MATH_ROUND },
+        { "pow", 2, OP_CODE::MATH_POW },
+    };
+
+    const auto* callee = std::get_if<VariableExpression>(&c.callee->as);
+    if (callee == nullptr) {
+        return std::nullopt;
+    }
+    // Locals, upvalues and script globals shadow the builtin wherever they are declared, so deferred
+    // bodies decide as eager ones do; a redefinition outside the script is caught at runtime.
+    const auto variable = resolve(callee->name);
+    if (!variable || variable->type != ScopeManager::Variable::Type::Global || scriptGlobals->contains(callee->name.lexeme)) {
+        return std::nullopt;
+    }
+    for (const Intrinsic& intrinsic : intrinsics) {
+        if (callee->name.lexeme == intrinsic.name && c.arguments.size() == intrinsic.arity) {
+            return intrinsic.op;
+        }
+    }
+    return std::nullopt;
+}
+
 ObjFunction* ByteCompiler::endCompiler()
 {
     emitReturn();
-    ObjFunction* function = functions.back();
+    ObjFunction* function = currentFunction();
+    function->upValueCount = functions.back().upvalues.size();
 
 #ifdef DEBUG_PRINT_CODE
-    if (!hadError) {
+    if (!hadError && disassemblyLog) {
+        disassemblyLog->push_back(function);
+    } else if (!hadError) {
         currentChunk().disassembleChunk(function->name != "" ? function->name : "<script>");
     }
 #endif
 
+    // Its chunk is no longer scanned as a root, and may hold young constants.
+    if (functions.back().object != nullptr) {
+        Heap::instance().rememberFunction(*function);
+    }
     functions.pop_back();
     scopeManager.exitScope();
 
@@ -480,6 +652,7 @@ void ByteCompiler::emitBytes(const uint8_t byte1, const uint8_t byte2) const
 
 void ByteCompiler::emitLoop(const int loopStart)
 {
+    currentChunk().addCacheSite();
     emitByte(cast(OP_CODE::LOOP));
 
     int offset = currentChunk().code.size() - loopStart + 2;
@@ -538,14 +711,14 @@ uint8_t ByteCompiler::makeConstant(const Value value)
 
 uint8_t ByteCompiler::identifierConstant(const Token& token)
 {
-    const auto constant = makeString(token.lexeme);
-    Value indexValue;
-    const auto it = stringConstants.find(constant.to_string());
+    auto& stringConstants = functions.back().stringConstants;
+    const auto it = stringConstants.find(token.lexeme);
     if (it == stringConstants.end()) {
-        stringConstants[token.lexeme] = emitConstant(constant);
-        return stringConstants[token.lexeme];
+        const uint8_t index = makeConstant(makeString(token.lexeme));
+        stringConstants[token.lexeme] = index;
+        return index;
     }
-    return it->second;
+    return static_cast<uint8_t>(it->second);
 }
 
 void ByteCompiler::errorAt(const Token& token, const std::string& message)
@@ -592,7 +765,14 @@ void ByteCompiler::emitGetVariable(const ScopeManager::Variable& var)
     case ScopeManager::Variable::Type::Upvalue:
         emitBytes(cast(OP_CODE::GET_UPVALUE), var.index);
         break;
+    case ScopeManager::Variable::Type::EnclosingLocal:
+        emitBytes(cast(OP_CODE::GET_ENCLOSING_LOCAL), var.index);
+        break;
+    case ScopeManager::Variable::Type::EnclosingUpvalue:
+        emitBytes(cast(OP_CODE::GET_ENCLOSING_UPVALUE), var.index);
+        break;
     case ScopeManager::Variable::Type::Global:
+        currentChunk().addCacheSite();
         emitBytes(cast(OP_CODE::GET_GLOBAL), identifierConstant(var.name));
         break;
     }
@@ -607,7 +787,14 @@ void ByteCompiler::emitSetVariable(const ScopeManager::Variable& var)
     case ScopeManager::Variable::Type::Upvalue:
         emitBytes(cast(OP_CODE::SET_UPVALUE), var.index);
         break;
+    case ScopeManager::Variable::Type::EnclosingLocal:
+        emitBytes(cast(OP_CODE::SET_ENCLOSING_LOCAL), var.index);
+        break;
+    case ScopeManager::Variable::Type::EnclosingUpvalue:
+        emitBytes(cast(OP_CODE::SET_ENCLOSING_UPVALUE), var.index);
+        break;
     case ScopeManager::Variable::Type::Global:
+        currentChunk().addCacheSite();
         emitBytes(cast(OP_CODE::SET_GLOBAL), identifierConstant(var.name));
         break;
     }
@@ -620,61 +807,88 @@ void ByteCompiler::beginScope()
 
 void ByteCompiler::endScope()
 {
-    for (auto& [variables, isClosure] = scopeManager.scopes.back(); const auto& var : variables) {
-        if (var.type == ScopeManager::Variable::Type::Local) {
-            emitByte(cast(OP_CODE::POP));
-        }
+    auto& variables = scopeManager.scopes.back().variables;
+    for (auto var = variables.rbegin(); var != variables.rend(); ++var) {
+        emitByte(cast(var->isCaptured ? OP_CODE::CLOSE_UPVALUE : OP_CODE::POP));
     }
     scopeManager.exitScope();
 }
 
-int ByteCompiler::resolveUpvalue(const Token& name)
+std::optional<ScopeManager::Variable> ByteCompiler::resolve(const Token& name)
 {
-    if (functions.size() == 1)
-        return -1;
+    using Type = ScopeManager::Variable::Type;
+    if (const auto* local = scopeManager.resolveLocal(name, 0)) {
+        return *local;
+    }
 
-    if (const auto variable = scopeManager.resolveVariable(name)) {
-        if (variable->type == ScopeManager::Variable::Type::Local) {
-            return addUpvalue(variable->index, true);
+    const size_t current = functions.size() - 1;
+    if (functions.back().isNonEscaping) {
+        // The declaring frame is always the caller's, so address its slots directly.
+        if (const auto* local = scopeManager.resolveLocal(name, 1)) {
+            return ScopeManager::Variable { name, Type::EnclosingLocal, local->index, local->isReadOnly, local->depth };
         }
-        if (variable->type == ScopeManager::Variable::Type::Upvalue) {
-            return addUpvalue(variable->index, false);
+        if (const int upvalue = resolveUpvalue(name, current - 1); upvalue != -1) {
+            return ScopeManager::Variable { name, Type::EnclosingUpvalue, static_cast<uint8_t>(upvalue), false, 0 };
         }
+    } else if (const int upvalue = resolveUpvalue(name, current); upvalue != -1) {
+        return ScopeManager::Variable { name, Type::Upvalue, static_cast<uint8_t>(upvalue), false, 0 };
+    }
+
+    if (const auto global = scopeManager.globals.find(name.lexeme); global != scopeManager.globals.end()) {
+        return global->second;
+    }
+    // Natives and forward references are only known at runtime.
+    return ScopeManager::Variable { name, Type::Global, 0, false, 0 };
+}
+
+int ByteCompiler::resolveUpvalue(const Token& name, const size_t function)
+{
+    if (function == 0)
+        return -1;
+
+    if (auto* local = scopeManager.resolveLocal(name, functions.size() - function)) {
+        local->isCaptured = true;
+        return addUpvalue(function, local->index, true);
     }
-    int upvalue = resolveUpvalue(name);
-    if (upvalue != -1) {
-        return addUpvalue(static_cast<uint8_t>(upvalue), false);
+
+    if (const int upvalue = resolveUpvalue(name, function - 1); upvalue != -1) {
+        return addUpvalue(function, static_cast<uint8_t>(upvalue), false);
     }
 
     return -1;
 }
 
-int ByteCompiler::addUpvalue(const uint8_t index, const bool isLocal)
+int ByteCompiler::addUpvalue(const size_t function, const uint8_t index, const bool isLocal)
 {
-    int upvalueCount = currentFunction()->upValueCount;
+    auto& upvalues = functions[function].upvalues;
 
-    for (int i = 0; i < upvalueCount; i++) {
+    for (size_t i = 0; i < upvalues.size(); i++) {
         if (const Upvalue& upvalue = upvalues[i]; upvalue.index == index && upvalue.isLocal == isLocal) {
-            return i;
+            return static_cast<int>(i);
         }
     }
 
+    if (upvalues.size() > UINT8_MAX) {
+        error("Too many closure variables in function.");
+        return 0;
+    }
+
     upvalues.push_back({ index, isLocal });
-    return currentFunction()->upValueCount++;
+    return static_cast<int>(upvalues.size() - 1);
 }
+
 Chunk& ByteCompiler::currentChunk() const
 {
-    return functions.back()->chunk;
+    return functions.back().function->chunk;
 }
 
 ObjFunction* ByteCompiler::currentFunction()
 {
-    return functions.back();
+    return functions.back().function;
 }
 Value ByteCompiler::makeString(const std::string& s)
 {
-    const std::string* internedString = StringInterner::instance().intern(s);
-    return { new Obj(ObjString(internedString)) };
+    return { StringInterner::instance().intern(s) };
 }
 
 int ByteCompiler::emitConstant(const Value& value) const
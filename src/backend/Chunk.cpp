@@ -13,6 +13,11 @@ void Chunk::disassembleChunk(const std::string& name) const
     }
 }
 
+void Chunk::allocateCaches()
+{
+    caches.resize(cacheSites.size());
+}
+
 int Chunk::writeConstant(const Value& value, const int line)
 {
     const int index = addConstant(value);
@@ -128,6 +133,26 @@ int Chunk::disassembleInstruction(int offset) const
         return byteInstruction("GET_UP_VALUE", offset);
     case cast(OP_CODE::SET_UPVALUE):
         return byteInstruction("SET_UP_VALUE", offset);
+    case cast(OP_CODE::GET_ENCLOSING_LOCAL):
+        return byteInstruction("OP_GET_ENCLOSING_LOCAL", offset);
+    case cast(OP_CODE::SET_ENCLOSING_LOCAL):
+        return byteInstruction("OP_SET_ENCLOSING_LOCAL", offset);
+    case cast(OP_CODE::GET_ENCLOSING_UPVALUE):
+        return byteInstruction("OP_GET_ENCLOSING_UPVALUE", offset);
+    case cast(OP_CODE::SET_ENCLOSING_UPVALUE):
+        return byteInstruction("OP_SET_ENCLOSING_UPVALUE", offset);
+    case cast(OP_CODE::MATH_SQRT):
+        return simpleInstruction("OP_MATH_SQRT", offset);
+    case cast(OP_CODE::MATH_ABS):
+        return simpleInstruction("OP_MATH_ABS", offset);
+    case cast(OP_CODE::MATH_FLOOR):
+        return simpleInstruction("OP_MATH_FLOOR", offset);
+    case cast(OP_CODE::MATH_CEIL):
+        return simpleInstruction("OP_MATH_CEIL", offset);
+    case cast(OP_CODE::MATH_ROUND):
+        return simpleInstruction("OP_MATH_ROUND", offset);
+    case cast(OP_CODE::MATH_POW):
+        return simpleInstruction("OP_MATH_POW", offset);
     default:
         std::cout << std::format("Unknown opcode {}\n", instruction);
         return offset + 1;
@@ -1,5 +1,6 @@
 #include "Compiler.h"
 #include "Chunk.h"
+#include "Heap.h"
 #include "Instructions.h"
 #include "Object.h"
 #include "Stringinterner.h"
@@ -9,7 +10,7 @@
 #include <cstdint>
 #include <iostream>
 #include <optional>
-#define DEBUG_PRINT_CODE
+#include <utility>
 Chunk& Compiler::currentChunk() const
 {
     return functions.back()->chunk;
@@ -201,8 +202,7 @@ void Compiler::block()
 
 Value Compiler::makeString(const std::string& s)
 {
-    const std::string* internedString = StringInterner::instance().intern(s);
-    return { new Obj(ObjString(internedString)) };
+    return { StringInterner::instance().intern(s) };
 }
 
 void Compiler::initRules()
@@ -314,7 +314,7 @@ int Compiler::resolveUpValue(const Token& name)
 Value Compiler::makeFunction(ObjFunction* function)
 {
     function->upValueCount = upvalues.size();
-    return { new Obj(ObjFunction(*function)) };
+    return { Heap::instance().allocate(ObjFunction(std::move(*function))) };
 }
 ObjFunction* Compiler::currentFunction()
 {
@@ -507,6 +507,9 @@ void Compiler::postfix(bool canAssign)
         error("Unexpected postfix operator.");
         return;
     }
+    if (setOp == cast(OP_CODE::SET_GLOBAL)) {
+        currentChunk().addCacheSite();
+    }
     emitBytes(setOp, static_cast<uint8_t>(arg));
     emitByte(cast(OP_CODE::POP));
 }
@@ -645,6 +648,7 @@ void Compiler::expressionStatement()
 
 void Compiler::emitLoop(const int loopStart)
 {
+    currentChunk().addCacheSite();
     emitByte(cast(OP_CODE::LOOP));
     const int offset = currentChunk().code.size() - loopStart + 2;
     if (offset > UINT16_MAX)
@@ -727,6 +731,7 @@ void Compiler::forStatement()
 void Compiler::call(bool canAssign)
 {
     uint8_t argCount = argumentList();
+    currentChunk().addCacheSite();
     emitBytes(cast(OP_CODE::CALL), argCount);
 }
 
@@ -935,10 +940,17 @@ void Compiler::namedVariable(const Token& name, const bool canAssign)
         getOp = cast(OP_CODE::GET_GLOBAL);
         setOp = cast(OP_CODE::SET_GLOBAL);
     }
+    const bool global = getOp == cast(OP_CODE::GET_GLOBAL);
     if (canAssign && match(Tokentype::EQUAL)) {
         expression();
+        if (global) {
+            currentChunk().addCacheSite();
+        }
         emitBytes(setOp, static_cast<uint8_t>(arg));
     } else {
+        if (global) {
+            currentChunk().addCacheSite();
+        }
         emitBytes(getOp, static_cast<uint8_t>(arg));
     }
 }
@@ -0,0 +1,157 @@
+#include "EscapeAnalysis.h"
+#include "Visit.h"
+#include <variant>
+
+bool EscapeAnalysis::isNonEscaping(const FunctionDeclaration& f,
+    const std::vector<std::unique_ptr<Statement>>& siblings,
+    const size_t declarationIndex)
+{
+    // Closures declared inside the candidate would need real upvalues to chain through it.
+    if (declaresFunction(*f.body)) {
+        return false;
+    }
+
+    EscapeAnalysis analysis { f.name.lexeme };
+    // Any mention inside its own body (recursion included) runs in a frame other than the declaring one.
+    analysis.visit(*f.body, true);
+    for (size_t i = declarationIndex + 1; i < siblings.size() && !analysis.escapes; i++) {
+        if (siblings[i]) {
+            analysis.visit(*siblings[i], false);
+        }
+    }
+    return !analysis.escapes;
+}
+
+bool EscapeAnalysis::declaresFunction(const Statement& stmt)
+{
+    return std::visit(overloaded {
+                          [](const FunctionDeclaration&) { return true; },
+                          [](const BlockStatement& b) {
+                              for (const auto& s : b.statements) {
+                                  if (s && declaresFunction(*s)) {
+                                      return true;
+                                  }
+                              }
+                              return false;
+                          },
+                          [](const IfStatement& i) {
+                              return declaresFunction(*i.thenBranch) || (i.elseBranch && declaresFunction(*i.elseBranch));
+                          },
+                          [](const WhileStatement& w) { return declaresFunction(*w.body); },
+                          [](const ForStatement& f) {
+                              return (f.initializer && declaresFunction(*f.initializer)) || declaresFunction(*f.body);
+                          },
+                          [](const SwitchStatement& s) {
+                              for (const auto& [value, body] : s.cases) {
+                                  if (body && declaresFunction(*body)) {
+                                      return true;
+                                  }
+                              }
+                              return false;
+                          },
+                          [](const auto&) { return false; } },
+        stmt.as);
+}
+
+void EscapeAnalysis::visit(const Statement& stmt, const bool nested)
+{
+    std::visit(overloaded {
+                   [&](const ExpressionStatement& e) { visit(*e.expression, nested); },
+                   [&](const PrintStatement& p) { visit(*p.expression, nested); },
+                   [&](const VariableDeclaration& v) {
+                       if (v.initializer) {
+                           visit(*v.initializer, nested);
+                       }
+                   },
+                   [&](const BlockStatement& b) {
+                       for (const auto& s : b.statements) {
+                           if (s) {
+                               visit(*s, nested);
+                           }
+                       }
+                   },
+                   [&](const IfStatement& i) {
+                       visit(*i.condition, nested);
+                       visit(*i.thenBranch, nested);
+                       if (i.elseBranch) {
+                           visit(*i.elseBranch, nested);
+                       }
+                   },
+                   [&](const WhileStatement& w) {
+                       visit(*w.condition, nested);
+                       visit(*w.body, nested);
+                   },
+                   [&](const ForStatement& f) {
+                       if (f.initializer) {
+                           visit(*f.initializer, nested);
+                       }
+                       if (f.condition) {
+                           visit(*f.condition, nested);
+                       }
+                       if (f.increment) {
+                           visit(*f.increment, nested);
+                       }
+                       visit(*f.body, nested);
+                   },
+                   [&](const ReturnStatement& r) {
+                       if (r.value) {
+                           visit(*r.value, nested);
+                       }
+                   },
+                   [&](const FunctionDeclaration& f) { visit(*f.body, true); },
+                   [&](const SwitchStatement& s) {
+                       visit(*s.expression, nested);
+                       for (const auto& [value, body] : s.cases) {
+                           if (value) {
+                               visit(*value, nested);
+                           }
+                           if (body) {
+                               visit(*body, nested);
+                           }
+                       }
+                   },
+                   [](const auto&) {} },
+        stmt.as);
+}
+
+void EscapeAnalysis::visit(const Expression& expr, const bool nested)
+{
+    std::visit(overloaded {
+                   [](const LiteralExpression&) {},
+                   [&](const VariableExpression& v) {
+                       if (v.name.lexeme == name) {
+                           escapes = true;
+                       }
+                   },
+                   [&](const UnaryExpression& u) { visit(*u.operand, nested); },
+                   [&](const BinaryExpression& b) {
+                       visit(*b.left, nested);
+                       visit(*b.right, nested);
+                   },
+                   [&](const AssignmentExpression& a) {
+                       if (a.name.lexeme == name) {
+                           escapes = true;
+                       }
+                       visit(*a.value, nested);
+                   },
+                   [&](const LogicalExpression& l) {
+                       visit(*l.left, nested);
+                       visit(*l.right, nested);
+                   },
+                   [&](const IncrementExpression& i) {
+                       if (i.name.lexeme == name) {
+                           escapes = true;
+                       }
+                   },
+                   [&](const CallExpression& c) {
+                       // A direct call from the declaring frame is the one use that cannot leak the closure.
+                       const auto* callee = std::get_if<VariableExpression>(&c.callee->as);
+                       if (!(callee && callee->name.lexeme == name && !nested)) {
+                           visit(*c.callee, nested);
+                       }
+                       for (const auto& arg : c.arguments) {
+                           visit(*arg, nested);
+                       }
+                   } },
+        expr.as);
+}
@@ -1,7 +1,42 @@
 #include "Object.h"
 #include "Visit.h"
+#include <cstring>
 #include <format>
 #include <iostream>
+#include <utility>
+#include <vector>
+
+uint32_t hashString(const std::string_view chars)
+{
+    uint32_t hash = 2166136261u;
+    for (const char c : chars) {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 16777619;
+    }
+    return hash != 0 ? hash : 1;
+}
+
+void ObjRope::copyTo(char* out) const
+{
+    // Iterative, since a string built piece by piece is a rope as deep as the number of pieces.
+    // Each piece comes with how many of its characters are used, as a tail buffer has more.
+    std::vector<std::pair<const Obj*, uint32_t>> pending { { this, length } };
+    while (!pending.empty()) {
+        const auto [piece, count] = pending.back();
+        pending.pop_back();
+        if (const auto* s = piece->asIf<ObjString>()) {
+            std::memcpy(out, s->chars(), count);
+            out += count;
+            continue;
+        }
+        const auto& rope = piece->as<ObjRope>();
+        const uint32_t leftLength = stringLength(*rope.left);
+        if (rope.right != nullptr) {
+            pending.emplace_back(rope.right, count - leftLength);
+        }
+        pending.emplace_back(rope.left, leftLength);
+    }
+}
 
 void Obj::print() const
 {
@@ -10,9 +45,14 @@ void Obj::print() const
 
 std::string Obj::to_string() const
 {
-    return std::visit(overloaded {
+    return visit(overloaded {
                           [](const ObjString& s) -> std::string {
-                              return *s.str;
+                              return std::string(s.view());
+                          },
+                          [](const ObjRope& r) -> std::string {
+                              std::string chars(r.length, '\0');
+                              r.copyTo(chars.data());
+                              return chars;
                           },
                           [](const ObjFunction& f) -> std::string {
                               return std::format("<function {}>", f.name);
@@ -25,9 +65,5 @@ std::string Obj::to_string() const
                           },
                           [](const ObjClosure& c) -> std::string {
                               return std::format("<closure {}>", c.pFunction->name);
-                          },
-                          [](const ObjUpvalue& u) -> std::string {
-                              return std::format("<up value {}>", u.location->to_string());
-                          } },
-        as);
+                          } });
 }
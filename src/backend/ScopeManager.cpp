@@ -33,36 +33,59 @@ bool ScopeManager::isGlobal(const std::string& name) const
     return globals.find(name) != globals.end();
 }
 
+size_t ScopeManager::localCount() const
+{
+    size_t count = 0;
+    for (auto it = scopes.rbegin(); it != scopes.rend(); ++it) {
+        count += it->variables.size();
+        if (it->isClosure) {
+            break;
+        }
+    }
+    return count;
+}
+
 ScopeManager::Variable ScopeManager::declareVariable(const Token& name, bool isReadOnly)
 {
     if (scopes.empty()) {
         globals[name.lexeme] = { name, Variable::Type::Global, 0, isReadOnly, 0 };
         return globals[name.lexeme];
     }
+    // Slot 0 of every frame holds the callee, so locals start at 1.
+    const auto slot = static_cast<uint8_t>(localCount() + 1);
     auto& currentScope = scopes.back();
-    Variable var(name, Variable::Type::Local, static_cast<uint8_t>(currentScope.variables.size()), isReadOnly, scopes.size() - 1);
+    Variable var(name, Variable::Type::Local, slot, isReadOnly, scopes.size() - 1);
     currentScope.variables.push_back(var);
     return var;
 }
 
-std::optional<ScopeManager::Variable> ScopeManager::resolveVariable(const Token& name)
+ScopeManager::Variable* ScopeManager::resolveLocal(const Token& name, size_t functionDepth)
 {
-    if (const auto globalIt = globals.find(name.lexeme); globalIt != globals.end()) {
-        return globalIt->second;
-    }
-
+    size_t depth = 0;
     for (auto it = scopes.rbegin(); it != scopes.rend(); ++it) {
-        for (const auto& var : it->variables) {
-            if (var.name.lexeme == name.lexeme) {
-                return var;
+        if (depth == functionDepth) {
+            for (auto var = it->variables.rbegin(); var != it->variables.rend(); ++var) {
+                if (var->name.lexeme == name.lexeme) {
+                    return &*var;
+                }
             }
         }
-        if (it->isClosure) {
-            Variable upvalue(name, Variable::Type::Upvalue, static_cast<uint8_t>(it->variables.size()), false, scopes.size() - 1 - std::distance(scopes.rbegin(), it));
-            it->variables.push_back(upvalue);
-            return upvalue;
+        if (it->isClosure && ++depth > functionDepth) {
+            break;
         }
     }
+    return nullptr;
+}
+
+std::optional<ScopeManager::Variable> ScopeManager::resolveVariable(const Token& name)
+{
+    if (const auto local = resolveLocal(name, 0)) {
+        return *local;
+    }
+
+    if (const auto globalIt = globals.find(name.lexeme); globalIt != globals.end()) {
+        return globalIt->second;
+    }
 
     return std::nullopt;
 }
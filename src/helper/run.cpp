@@ -1,12 +1,17 @@
 #include "run.h"
+#include "AotEmitter.h"
 #include "ByteCompiler.h"
+#include "Heap.h"
 #include "Parser.h"
 #include "Printer.h"
 #include "Scanner.h"
 #include "Statement.h"
+#include "Stringinterner.h"
 #include "vMachine.h"
+#include <format>
 #include <fstream>
 #include <iostream>
+#include <optional>
 #include <string>
 
 std::string readFile(const std::string& path)
@@ -17,8 +22,11 @@ std::string readFile(const std::string& path)
     return parsed_file;
 }
 
-void runFile(const std::string& path)
+void runFile(const std::string& path, const RunOptions& options)
 {
+    Heap::instance().setStress(options.gcStress);
+    Heap::instance().setGenerational(options.gcGenerational);
+    Heap::instance().setPauseBudget(std::chrono::microseconds { options.gcPauseBudgetUs });
     vMachine vm {};
     std::string source = readFile(path);
     Scanner scanner { source };
@@ -27,10 +35,51 @@ void runFile(const std::string& path)
     std::vector<std::unique_ptr<Statement>> statments = parser.parseProgram();
     Printer pr;
     pr.print(statments);
-    ByteCompiler bc {};
+    ByteCompiler bc { options.compilation };
     auto main = bc.compile(statments);
+    vm.setJitEnabled(options.jit);
     vm.load(main);
     vm.run();
+    if (options.jitStats) {
+        const JitStats& stats = vm.getJitStats();
+        std::cerr << "jit: " << stats.functionsCompiled << " functions compiled, "
+                  << stats.tracesCompiled << " traces compiled, "
+                  << stats.tracesExecuted << " traces executed, "
+                  << stats.tracesAborted << " traces aborted" << std::endl;
+    }
+    if (options.gcStats) {
+        const GcStats stats = Heap::instance().stats();
+        std::cerr << "gc: " << stats.objectsAllocated << " objects allocated ("
+                  << stats.bytesAllocated << " bytes), "
+                  << stats.minorCollections << " minor, "
+                  << stats.majorCollections << " major collections, "
+                  << stats.pauseTotalNs / 1000 << " us paused (max " << stats.pauseMaxNs / 1000 << " us), "
+                  << stats.objectsFreed << " objects freed, "
+                  << stats.bytesFreed << " bytes freed, "
+                  << stats.bytesLive << " bytes live, "
+                  << stats.bytesReserved << " bytes reserved" << std::endl;
+        std::cerr << "gc pauses:";
+        for (size_t i = 0; i < stats.pauseHistogram.size(); i++) {
+            if (stats.pauseHistogram[i] == 0) {
+                continue;
+            }
+            if (i == 0) {
+                std::cerr << " <1us: ";
+            } else if (i == stats.pauseHistogram.size() - 1) {
+                std::cerr << " >=" << (1u << (i - 1)) << "us: ";
+            } else {
+                std::cerr << " " << (1u << (i - 1)) << "-" << (1u << i) << "us: ";
+            }
+            std::cerr << stats.pauseHistogram[i];
+        }
+        std::cerr << std::endl;
+        const InternStats strings = StringInterner::instance().stats();
+        std::cerr << std::format("strings: {} interned, {} slots (load {:.2f}), {} tombstones, probe length mean {:.2f} max {}",
+            strings.strings, strings.capacity,
+            strings.capacity == 0 ? 0.0 : static_cast<double>(strings.strings) / static_cast<double>(strings.capacity),
+            strings.tombstones, strings.meanProbe, strings.maxProbe)
+                  << std::endl;
+    }
     // Compiler compiler { tokens };
     // if (std::optional<ObjFunction*> main = compiler.compile()) {
     //     vm.load(*main);
@@ -40,6 +89,28 @@ void runFile(const std::string& path)
     // }
 }
 
+bool emitFile(const std::string& path, const std::string& output)
+{
+    std::string source = readFile(path);
+    Scanner scanner { source };
+    auto tokens = scanner.tokenize();
+    Parser parser { tokens };
+    std::vector<std::unique_ptr<Statement>> statments = parser.parseProgram();
+    ByteCompiler bc { FunctionCompilation::Eager };
+    auto main = bc.compile(statments);
+    if (main == nullptr) {
+        std::cerr << "Compilation failed." << std::endl;
+        return false;
+    }
+    const std::optional<std::string> unit = AotEmitter::emit(*main);
+    if (!unit) {
+        std::cerr << "Cannot compile " << path << " ahead of time." << std::endl;
+        return false;
+    }
+    std::ofstream(output) << *unit;
+    return true;
+}
+
 void runRepl()
 {
     std::string line;
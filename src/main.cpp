@@ -1,12 +1,44 @@
 #include "run.h"
 #include <iostream>
+#include <string>
 int main(const int argc, const char* argv[])
 {
-    if (argc == 1) {
+    RunOptions options;
+    std::string emitOutput;
+    int arg = 1;
+    for (; arg < argc && std::string(argv[arg]).starts_with("--"); arg++) {
+        if (std::string(argv[arg]) == "--lazy") {
+            options.compilation = FunctionCompilation::Lazy;
+        } else if (std::string(argv[arg]) == "--parallel-compile") {
+            options.compilation = FunctionCompilation::Parallel;
+        } else if (std::string(argv[arg]) == "--no-jit") {
+            options.jit = false;
+        } else if (std::string(argv[arg]) == "--jit-stats") {
+            options.jitStats = true;
+        } else if (std::string(argv[arg]) == "--gc-stress") {
+            options.gcStress = true;
+        } else if (std::string(argv[arg]) == "--no-generational") {
+            options.gcGenerational = false;
+        } else if (std::string(argv[arg]) == "--gc-stats") {
+            options.gcStats = true;
+        } else if (std::string(argv[arg]) == "--gc-pause-budget" && arg + 1 < argc) {
+            options.gcPauseBudgetUs = std::stol(argv[++arg]);
+        } else if (std::string(argv[arg]) == "--emit-cpp" && arg + 1 < argc) {
+            emitOutput = argv[++arg];
+        } else {
+            std::cout << "Unknown option " << argv[arg] << std::endl;
+            return 64;
+        }
+    }
+
+    if (!emitOutput.empty() && arg == argc - 1) {
+        return emitFile(argv[arg], emitOutput) ? 0 : 65;
+    }
+    if (arg == argc) {
         runRepl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
+    } else if (arg == argc - 1) {
+        runFile(argv[arg], options);
     } else {
-        std::cout << "Usage vm [script] || vm" << std::endl;
+        std::cout << "Usage vm [--lazy | --parallel-compile] [--no-jit] [--jit-stats] [--gc-stress] [--no-generational] [--gc-pause-budget us] [--gc-stats] [--emit-cpp output.cpp] [script] || vm" << std::endl;
     }
 }
@@ -0,0 +1,588 @@
+#include "Heap.h"
+#include "ByteCompiler.h"
+#include "Stringinterner.h"
+#include "Visit.h"
+#include "vMachine.h"
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <utility>
+
+// Bounds one increment of collector work by the pause budget; under stress, by a single unit.
+class Heap::Budget {
+public:
+    Budget() = default;
+    Budget(const std::chrono::microseconds limit, const bool stress)
+        : deadline(std::chrono::steady_clock::now() + limit)
+        , single(stress)
+    {
+    }
+
+    // Called after each unit of work. The clock is only read every CHECK_INTERVAL units.
+    bool spent()
+    {
+        if (single) {
+            return true;
+        }
+        return ++work % CHECK_INTERVAL == 0 && deadline != std::chrono::steady_clock::time_point::max()
+            && std::chrono::steady_clock::now() >= deadline;
+    }
+
+private:
+    static constexpr size_t CHECK_INTERVAL = 256;
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    size_t work = 0;
+    bool single = false;
+};
+
+// Bytes taken by an object, including what is stored after it.
+static size_t objectSize(const Obj* obj)
+{
+    return obj->visit(overloaded {
+        [](const ObjClosure& c) { return sizeof(ObjClosure) + c.upValues.size() * sizeof(ObjUpvalue*); },
+        [](const ObjString& s) { return sizeof(ObjString) + s.length + 1; },
+        [](const auto& payload) { return sizeof(payload); } });
+}
+
+ObjClosure* Heap::allocateClosure(ObjFunction* function)
+{
+    std::lock_guard lock { mutex };
+    auto* closure = new (reserve(sizeof(ObjClosure) + function->upValueCount * sizeof(ObjUpvalue*))) ObjClosure(function);
+    closure->next = young;
+    young = closure;
+    return closure;
+}
+
+ObjString* Heap::allocateString(const size_t length)
+{
+    std::lock_guard lock { mutex };
+    auto* string = new (reserve(sizeof(ObjString) + length + 1)) ObjString(static_cast<uint32_t>(length));
+    string->next = young;
+    young = string;
+    return string;
+}
+
+ObjString* Heap::allocateString(const std::string_view chars)
+{
+    ObjString* string = allocateString(chars.size());
+    std::memcpy(string->data(), chars.data(), chars.size());
+    return string;
+}
+
+ObjUpvalue* Heap::allocateUpvalue(Value* slot)
+{
+    std::lock_guard lock { mutex };
+    auto* upvalue = new (reserve(sizeof(ObjUpvalue))) ObjUpvalue(slot);
+    upvalue->nextAllocated = upvalues;
+    upvalues = upvalue;
+    return upvalue;
+}
+
+void Heap::collect()
+{
+    std::lock_guard lock { mutex };
+    const auto start = std::chrono::steady_clock::now();
+    finishSweeping();
+    collectLocked(true);
+    finishSweeping();
+    recordPause(start);
+}
+
+void Heap::setStress(const bool enabled)
+{
+    std::lock_guard lock { mutex };
+    stress = enabled;
+}
+
+void Heap::setGrowthFactor(const double factor)
+{
+    std::lock_guard lock { mutex };
+    growthFactor = std::max(factor, 1.0);
+}
+
+void Heap::setGenerational(const bool enabled)
+{
+    std::lock_guard lock { mutex };
+    generational = enabled;
+}
+
+void Heap::setPauseBudget(const std::chrono::microseconds budget)
+{
+    std::lock_guard lock { mutex };
+    pauseBudget = std::max(budget, std::chrono::microseconds::zero());
+}
+
+GcStats Heap::stats() const
+{
+    std::lock_guard lock { mutex };
+    GcStats stats = counters;
+    stats.bytesLive = heapBytes;
+    stats.bytesReserved = blocks.size() * BLOCK_SIZE + largeBytes;
+    return stats;
+}
+
+void Heap::addRoots(vMachine* vm)
+{
+    std::lock_guard lock { mutex };
+    machines.push_back(vm);
+}
+
+void Heap::removeRoots(vMachine* vm)
+{
+    std::lock_guard lock { mutex };
+    std::erase(machines, vm);
+}
+
+void Heap::addRoots(ByteCompiler* compiler)
+{
+    std::lock_guard lock { mutex };
+    compilers.push_back(compiler);
+}
+
+void Heap::removeRoots(ByteCompiler* compiler)
+{
+    std::lock_guard lock { mutex };
+    std::erase(compilers, compiler);
+}
+
+void Heap::markValue(const Value& value)
+{
+    if (value.isObj()) {
+        markObject(value.asObj());
+    }
+}
+
+void Heap::markObject(Obj* obj)
+{
+    if (obj == nullptr || obj->marked || (minor && obj->old)) {
+        return;
+    }
+    obj->marked = true;
+    grey.push_back(obj);
+}
+
+void Heap::markUpvalue(ObjUpvalue* upvalue)
+{
+    // Upvalues are only freed by major collections, so a minor one just wants the value.
+    if (!minor) {
+        if (upvalue->marked) {
+            return;
+        }
+        upvalue->marked = true;
+    }
+    // An open upvalue's value lives on a stack, which is a root already.
+    markValue(upvalue->closed);
+}
+
+void Heap::markChunk(const Chunk& chunk)
+{
+    for (const Value& constant : chunk.pool) {
+        markValue(constant);
+    }
+    // A cached callee is compared by address, so it must not be freed and its address reused.
+    for (const InlineCache& cache : chunk.caches) {
+        markObject(cache.callee);
+    }
+}
+
+// While marking, the barriers shade what was stored instead of remembering it: no minor
+// collection runs before the major one finishes, and that one forgets the remembered sets.
+void Heap::rememberUpvalue(ObjUpvalue* upvalue)
+{
+    if (upvalue->remembered && !marking) {
+        return;
+    }
+    std::lock_guard lock { mutex };
+    if (marking) {
+        markValue(upvalue->closed);
+    } else if (!upvalue->remembered) {
+        upvalue->remembered = true;
+        rememberedUpvalues.push_back(upvalue);
+    }
+}
+
+void Heap::rememberCache(InlineCache& cache)
+{
+    if (cache.remembered && !marking) {
+        return;
+    }
+    std::lock_guard lock { mutex };
+    if (marking) {
+        markObject(cache.callee);
+    } else if (!cache.remembered) {
+        cache.remembered = true;
+        rememberedCaches.push_back(&cache);
+    }
+}
+
+void Heap::rememberFunction(ObjFunction& function)
+{
+    if (function.remembered && !marking) {
+        return;
+    }
+    std::lock_guard lock { mutex };
+    if (marking) {
+        markChunk(function.chunk);
+        markObject(function.bareClosure);
+    } else if (!function.remembered) {
+        function.remembered = true;
+        rememberedFunctions.push_back(&function);
+    }
+}
+
+void Heap::rememberRope(ObjRope& rope)
+{
+    if (rope.remembered && !marking) {
+        return;
+    }
+    std::lock_guard lock { mutex };
+    if (marking) {
+        markObject(rope.left);
+    } else if (!rope.remembered) {
+        rope.remembered = true;
+        rememberedRopes.push_back(&rope);
+    }
+}
+
+Heap::NoCollection::NoCollection()
+{
+    Heap& heap = instance();
+    std::lock_guard lock { heap.mutex };
+    heap.paused++;
+}
+
+Heap::NoCollection::~NoCollection()
+{
+    Heap& heap = instance();
+    std::lock_guard lock { heap.mutex };
+    heap.paused--;
+}
+
+void* Heap::reserve(const size_t size)
+{
+    sinceStep += size;
+    if (paused == 0 && (sinceStep >= BLOCK_SIZE || stress)) {
+        sinceStep = 0;
+        step();
+    }
+    const size_t slot = slotSize(size);
+    heapBytes += slot;
+    youngBytes += slot;
+    counters.objectsAllocated++;
+    counters.bytesAllocated += slot;
+    if (slot > MAX_SMALL) {
+        largeBytes += slot;
+        return ::operator new(slot);
+    }
+    return takeSlot(slot);
+}
+
+void* Heap::takeSlot(const size_t size)
+{
+    const size_t sizeClass = Heap::sizeClass(size);
+    Block*& block = current[sizeClass];
+    if (block == nullptr || (block->freeSlots == nullptr && block->used + size > BLOCK_SIZE)) {
+        if (partial[sizeClass].empty()) {
+            block = takeBlock(size);
+            blocks.push_back(block);
+        } else {
+            block = partial[sizeClass].back();
+            partial[sizeClass].pop_back();
+        }
+    }
+    block->live++;
+    if (block->freeSlots != nullptr) {
+        void* slot = block->freeSlots;
+        block->freeSlots = *static_cast<void**>(slot);
+        return slot;
+    }
+    void* slot = reinterpret_cast<std::byte*>(block) + block->used;
+    block->used += size;
+    return slot;
+}
+
+// Gives back the memory of a destroyed object.
+void Heap::release(void* memory, const size_t size)
+{
+    heapBytes -= size;
+    counters.bytesFreed += size;
+    if (size > MAX_SMALL) {
+        largeBytes -= size;
+        ::operator delete(memory);
+        return;
+    }
+    Block* block = blockOf(memory);
+    *static_cast<void**>(memory) = block->freeSlots;
+    block->freeSlots = memory;
+    block->live--;
+}
+
+bool Heap::collectionDue() const
+{
+    if (stress) {
+        return true;
+    }
+    return generational ? youngBytes >= NURSERY_BYTES : heapBytes >= nextMajor;
+}
+
+// One pause: an increment of marking, a minor collection, or an increment of sweeping.
+void Heap::step()
+{
+    const auto start = std::chrono::steady_clock::now();
+    if (marking) {
+        Budget budget { pauseBudget, stress };
+        traceReferences(budget);
+        if (grey.empty()) {
+            collectLocked(true);
+        }
+    } else if (collectionDue()) {
+        if (generational) {
+            collectLocked(false);
+        }
+        if (!generational || heapBytes >= nextMajor || (stress && pauseBudget.count() > 0)) {
+            startMajor();
+        }
+    } else if (sweeping) {
+        Budget budget { pauseBudget, stress };
+        sweep(unswept, budget);
+        if (unswept == nullptr) {
+            sweepUpvalues(budget);
+        }
+        if (unswept == nullptr && unsweptUpvalues == nullptr) {
+            finishSweeping();
+        }
+    } else {
+        return;
+    }
+    recordPause(start);
+}
+
+void Heap::startMajor()
+{
+    finishSweeping();
+    if (pauseBudget.count() == 0) {
+        collectLocked(true);
+        finishSweeping();
+        return;
+    }
+    marking = true;
+    markRoots();
+}
+
+void Heap::markRoots()
+{
+    for (vMachine* vm : machines) {
+        vm->markRoots(*this);
+    }
+    for (ByteCompiler* compiler : compilers) {
+        compiler->markRoots(*this);
+    }
+}
+
+// A minor collection, or the end of a major one: after incremental marking, the roots are
+// scanned again since stores into them have no barrier. Old space is left for sweeping.
+void Heap::collectLocked(const bool full)
+{
+    minor = !full;
+    markRoots();
+    if (minor) {
+        for (ObjUpvalue* upvalue : rememberedUpvalues) {
+            markValue(upvalue->closed);
+        }
+        for (InlineCache* cache : rememberedCaches) {
+            markObject(cache->callee);
+        }
+        for (ObjFunction* function : rememberedFunctions) {
+            markChunk(function->chunk);
+            markObject(function->bareClosure);
+        }
+        for (ObjRope* rope : rememberedRopes) {
+            markObject(rope->left);
+        }
+    }
+    Budget unlimited;
+    traceReferences(unlimited);
+    // Every survivor is old from here on, so nothing needs remembering; and the entries may be swept.
+    forgetRemembered();
+    if (full) {
+        marking = false;
+        // Dead strings stay in old space until swept, so intern must not find them from here on.
+        StringInterner::instance().removeUnmarked();
+        // Nursery survivors join `old` while the rest of it is swept.
+        unswept = std::exchange(old, nullptr);
+        unsweptUpvalues = std::exchange(upvalues, nullptr);
+        sweeping = true;
+        nextMajor = std::numeric_limits<size_t>::max();
+        counters.majorCollections++;
+    } else {
+        counters.minorCollections++;
+    }
+    sweep(young, unlimited);
+    youngBytes = 0;
+    recycleBlocks();
+    minor = false;
+}
+
+void Heap::traceReferences(Budget& budget)
+{
+    while (!grey.empty()) {
+        Obj* obj = grey.back();
+        grey.pop_back();
+        obj->visit(overloaded {
+                       [this](const ObjFunction& f) {
+                           markChunk(f.chunk);
+                           markObject(f.bareClosure);
+                       },
+                       // The function is a constant of the function that created the closure,
+                       // and so reachable from the script's constant pool.
+                       [this](const ObjClosure& c) {
+                           // Null while the CLOSURE instruction is still capturing.
+                           for (ObjUpvalue* upvalue : c.upValues) {
+                               if (upvalue != nullptr) {
+                                   markUpvalue(upvalue);
+                               }
+                           }
+                       },
+                       [this](const ObjRope& r) {
+                           markObject(r.left);
+                           markObject(r.right);
+                       },
+                       [](const auto&) {} });
+        if (budget.spent()) {
+            return;
+        }
+    }
+}
+
+void Heap::forgetRemembered()
+{
+    for (ObjUpvalue* upvalue : rememberedUpvalues) {
+        upvalue->remembered = false;
+    }
+    for (InlineCache* cache : rememberedCaches) {
+        cache->remembered = false;
+    }
+    for (ObjFunction* function : rememberedFunctions) {
+        function->remembered = false;
+    }
+    for (ObjRope* rope : rememberedRopes) {
+        rope->remembered = false;
+    }
+    rememberedUpvalues.clear();
+    rememberedCaches.clear();
+    rememberedFunctions.clear();
+    rememberedRopes.clear();
+}
+
+// Frees the unmarked objects of `list` until the budget is spent. Survivors are unmarked and
+// moved to the old list.
+void Heap::sweep(Obj*& list, Budget& budget)
+{
+    size_t freed = 0;
+    while (list != nullptr) {
+        Obj* obj = list;
+        list = obj->next;
+        if (obj->marked) {
+            obj->marked = false;
+            obj->old = true;
+            obj->next = old;
+            old = obj;
+        } else {
+            // A major collection has dropped its dead strings already.
+            if (minor && obj->is<ObjString>()) {
+                StringInterner::instance().remove(&obj->as<ObjString>());
+            }
+            const size_t size = slotSize(objectSize(obj));
+            obj->visit([](auto& payload) { std::destroy_at(&payload); });
+            release(obj, size);
+            freed++;
+        }
+        if (budget.spent()) {
+            break;
+        }
+    }
+    counters.objectsFreed += freed;
+}
+
+void Heap::finishSweeping()
+{
+    if (!sweeping) {
+        return;
+    }
+    Budget unlimited;
+    sweep(unswept, unlimited);
+    sweepUpvalues(unlimited);
+    sweeping = false;
+    recycleBlocks();
+    nextMajor = std::max(NURSERY_BYTES, static_cast<size_t>(static_cast<double>(heapBytes) * growthFactor));
+}
+
+void Heap::sweepUpvalues(Budget& budget)
+{
+    size_t freed = 0;
+    while (unsweptUpvalues != nullptr) {
+        ObjUpvalue* upvalue = unsweptUpvalues;
+        unsweptUpvalues = upvalue->nextAllocated;
+        if (upvalue->marked) {
+            upvalue->marked = false;
+            upvalue->nextAllocated = upvalues;
+            upvalues = upvalue;
+        } else {
+            release(upvalue, slotSize(sizeof(ObjUpvalue)));
+            freed++;
+        }
+        if (budget.spent()) {
+            break;
+        }
+    }
+    counters.objectsFreed += freed;
+}
+
+// Frees or caches the empty pages and rebuilds the lists of pages with room. Pages still
+// holding unswept objects count them as live.
+void Heap::recycleBlocks()
+{
+    current.fill(nullptr);
+    for (std::vector<Block*>& list : partial) {
+        list.clear();
+    }
+    std::erase_if(blocks, [this](Block* block) {
+        if (block->live == 0) {
+            if (freeBlocks.size() < NURSERY_BYTES / BLOCK_SIZE) {
+                freeBlocks.push_back(block);
+            } else {
+                ::operator delete(block, std::align_val_t { BLOCK_SIZE });
+            }
+            return true;
+        }
+        if (block->freeSlots != nullptr || block->used + block->slotSize <= BLOCK_SIZE) {
+            partial[sizeClass(block->slotSize)].push_back(block);
+        }
+        return false;
+    });
+}
+
+Heap::Block* Heap::takeBlock(const size_t slotSize)
+{
+    void* memory;
+    if (!freeBlocks.empty()) {
+        memory = freeBlocks.back();
+        freeBlocks.pop_back();
+    } else {
+        memory = ::operator new(BLOCK_SIZE, std::align_val_t { BLOCK_SIZE });
+    }
+    return new (memory) Block { slotSize, FIRST_SLOT, 0, nullptr };
+}
+
+void Heap::recordPause(const std::chrono::steady_clock::time_point start)
+{
+    const auto pause = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    counters.pauseTotalNs += pause;
+    counters.pauseMaxNs = std::max(counters.pauseMaxNs, pause);
+    const size_t bucket = std::min<size_t>(std::bit_width(pause / 1000), counters.pauseHistogram.size() - 1);
+    counters.pauseHistogram[bucket]++;
+}
@@ -0,0 +1,704 @@
+#include "Jit.h"
+#include "Instructions.h"
+#include "Verifier.h"
+#include "vMachine.h"
+#include <cstddef>
+#include <cstring>
+#include <initializer_list>
+#include <utility>
+
+#ifdef VM_JIT_AVAILABLE
+#include <sys/mman.h>
+
+void MachineCode::release()
+{
+    if (size != 0) {
+        munmap(address, size);
+    }
+}
+
+static bool isMath(const uint8_t byte)
+{
+    return byte >= cast(OP_CODE::MATH_SQRT) && byte <= cast(OP_CODE::MATH_POW);
+}
+
+// Register use inside generated code: rbx = the VM, r12 = &stack.top, r13 = frame slots,
+// r14 = stack top, r15 = &globalsVersion. The VM's own addresses arrive as arguments, so the
+// code can be shared by every VM that runs the function. All five are callee-saved and survive
+// helper calls; r14 is written back to the VM before every call and reloaded after it.
+class Jit::Assembler {
+public:
+    std::vector<uint8_t> code;
+    // rel32 fields that branch to the shared failure exit.
+    std::vector<size_t> failures;
+
+    void emit(const std::initializer_list<uint8_t> bytes)
+    {
+        code.insert(code.end(), bytes);
+    }
+
+    void emit32(const uint32_t value)
+    {
+        for (int i = 0; i < 4; i++) {
+            code.push_back(static_cast<uint8_t>(value >> (8 * i)));
+        }
+    }
+
+    void emit64(const uint64_t value)
+    {
+        for (int i = 0; i < 8; i++) {
+            code.push_back(static_cast<uint8_t>(value >> (8 * i)));
+        }
+    }
+
+    // Emits a branch with an empty rel32 and returns where the displacement lives.
+    size_t jump(const std::initializer_list<uint8_t> opcode)
+    {
+        emit(opcode);
+        const size_t at = code.size();
+        emit32(0);
+        return at;
+    }
+
+    void bind(const size_t at, const size_t target)
+    {
+        const auto displacement = static_cast<int32_t>(static_cast<int64_t>(target) - static_cast<int64_t>(at + 4));
+        std::memcpy(&code[at], &displacement, sizeof(displacement));
+    }
+
+    // Entered as entry(slots, vm, top, globalsVersion); see Jit::Entry.
+    void prologue()
+    {
+        emit({ 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57 }); // push rbx, r12, r13, r14, r15
+        emit({ 0x49, 0x89, 0xFD }); // mov r13, rdi
+        emit({ 0x48, 0x89, 0xF3 }); // mov rbx, rsi
+        emit({ 0x49, 0x89, 0xD4 }); // mov r12, rdx
+        emit({ 0x49, 0x89, 0xCF }); // mov r15, rcx
+        reloadTop();
+    }
+
+    void epilogue()
+    {
+        emit({ 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3 }); // pop r15..rbx; ret
+    }
+
+    // Copies the code into fresh executable memory; empty if the mapping fails.
+    MachineCode install() const
+    {
+        void* memory = mmap(nullptr, code.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            return {};
+        }
+        std::memcpy(memory, code.data(), code.size());
+        MachineCode installed { memory, code.size() };
+        if (mprotect(memory, code.size(), PROT_READ | PROT_EXEC) != 0) {
+            return {};
+        }
+        return installed;
+    }
+
+    void syncTop() { emit({ 0x4D, 0x89, 0x34, 0x24 }); } // mov [r12], r14
+    void reloadTop() { emit({ 0x4D, 0x8B, 0x34, 0x24 }); } // mov r14, [r12]
+
+    // Calls helper(vm, rsi); a false result leaves through the failure exit.
+    void callHelper(const uint64_t helper, const uint64_t rsi)
+    {
+        syncTop();
+        emit({ 0x48, 0x89, 0xDF }); // mov rdi, rbx
+        emit({ 0x48, 0xBE }); // mov rsi, imm64
+        emit64(rsi);
+        emit({ 0x48, 0xB8 }); // mov rax, imm64
+        emit64(helper);
+        emit({ 0xFF, 0xD0 }); // call rax
+        reloadTop();
+        emit({ 0x84, 0xC0 }); // test al, al
+        failures.push_back(jump({ 0x0F, 0x84 })); // jz fail
+    }
+
+    void pushBits(const uint64_t bits)
+    {
+        emit({ 0x48, 0xB8 }); // mov rax, imm64
+        emit64(bits);
+        pushRax();
+    }
+
+    void getLocal(const uint8_t slot)
+    {
+        emit({ 0x49, 0x8B, 0x85 }); // mov rax, [r13 + disp32]
+        emit32(slot * sizeof(Value));
+        pushRax();
+    }
+
+    void setLocal(const uint8_t slot)
+    {
+        emit({ 0x49, 0x8B, 0x46, 0xF8 }); // mov rax, [r14 - 8]
+        emit({ 0x49, 0x89, 0x85 }); // mov [r13 + disp32], rax
+        emit32(slot * sizeof(Value));
+    }
+
+    void pop() { emit({ 0x49, 0x83, 0xEE, 0x08 }); } // sub r14, 8
+
+    // The number-only templates below return the branches they take for any other operands;
+    // the caller binds them to interpretOnSlowPath or, in a trace, to a guard exit.
+
+    // addsd/mulsd on two numbers.
+    std::vector<size_t> arithmetic(const uint8_t sseOpcode)
+    {
+        std::vector<size_t> slow = loadNumberOperands();
+        emit({ 0xF2, 0x0F, sseOpcode, 0xC1 }); // op xmm0, xmm1
+        emit({ 0x66, 0x48, 0x0F, 0x7E, 0xC0 }); // movq rax, xmm0
+        finishBinary();
+        return slow;
+    }
+
+    // `swapped` compares b against a, so seta/setae also cover < and <=.
+    std::vector<size_t> compare(const uint8_t setcc, const bool swapped, const bool equality)
+    {
+        std::vector<size_t> slow = loadNumberOperands();
+        if (swapped) {
+            emit({ 0x66, 0x0F, 0x2E, 0xC8 }); // ucomisd xmm1, xmm0
+        } else {
+            emit({ 0x66, 0x0F, 0x2E, 0xC1 }); // ucomisd xmm0, xmm1
+        }
+        emit({ 0x0F, setcc, 0xC0 }); // setcc al
+        if (equality) {
+            emit({ 0x0F, 0x9B, 0xC2 }); // setnp dl
+            emit({ 0x20, 0xD0 }); // and al, dl
+        }
+        emit({ 0x0F, 0xB6, 0xC0 }); // movzx eax, al
+        emit({ 0x83, 0xC0, static_cast<uint8_t>(Value::TAG_FALSE) }); // add eax, TAG_FALSE
+        emit({ 0x48, 0x09, 0xC8 }); // or rax, rcx
+        finishBinary();
+        return slow;
+    }
+
+    std::vector<size_t> negate()
+    {
+        emit({ 0x49, 0x8B, 0x46, 0xF8 }); // mov rax, [r14 - 8]
+        emit({ 0x48, 0xB9 }); // mov rcx, imm64
+        emit64(Value::QNAN);
+        emit({ 0x49, 0x89, 0xC0 }); // mov r8, rax
+        emit({ 0x49, 0x21, 0xC8 }); // and r8, rcx
+        emit({ 0x49, 0x39, 0xC8 }); // cmp r8, rcx
+        const size_t slow = jump({ 0x0F, 0x84 }); // je slow
+        emit({ 0x48, 0x0F, 0xBA, 0xF8, 0x3F }); // btc rax, 63
+        emit({ 0x49, 0x89, 0x46, 0xF8 }); // mov [r14 - 8], rax
+        return { slow };
+    }
+
+    // Reads and writes go through the instruction's inline cache while its version is current.
+    std::vector<size_t> getGlobal(const InlineCache& cache)
+    {
+        const size_t slow = loadGlobalCell(cache);
+        emit({ 0x48, 0x8B, 0x00 }); // mov rax, [rax]
+        pushRax();
+        return { slow };
+    }
+
+    // Objects take the slow path, which applies the collector's write barrier.
+    std::vector<size_t> setGlobal(const InlineCache& cache)
+    {
+        const size_t slow = loadGlobalCell(cache);
+        emit({ 0x49, 0x8B, 0x56, 0xF8 }); // mov rdx, [r14 - 8]
+        emit({ 0x48, 0x89, 0xD1 }); // mov rcx, rdx
+        emit({ 0x48, 0xC1, 0xE9, 0x32 }); // shr rcx, 50
+        emit({ 0x81, 0xF9, 0xFF, 0x3F, 0x00, 0x00 }); // cmp ecx, 0x3FFF (sign and quiet NaN: an Obj*)
+        const size_t object = jump({ 0x0F, 0x84 }); // je slow
+        emit({ 0x48, 0x89, 0x10 }); // mov [rax], rdx
+        return { slow, object };
+    }
+
+    // Routes `slow` to the interpreter's handler for the instruction at `ip`.
+    void interpretOnSlowPath(const std::vector<size_t>& slow, const uint64_t ip)
+    {
+        const size_t done = jump({ 0xE9 }); // jmp done
+        for (const size_t at : slow) {
+            bind(at, code.size());
+        }
+        callHelper(reinterpret_cast<uint64_t>(&Jit::step), ip);
+        bind(done, code.size());
+    }
+
+    // Branches to the returned fixups when the top of the stack is falsey.
+    std::vector<size_t> jumpIfFalse()
+    {
+        std::vector<size_t> taken;
+        emit({ 0x49, 0x8B, 0x46, 0xF8 }); // mov rax, [r14 - 8]
+        emit({ 0x48, 0xB9 }); // mov rcx, imm64
+        emit64(Value(false).bits);
+        emit({ 0x48, 0x39, 0xC8 }); // cmp rax, rcx
+        taken.push_back(jump({ 0x0F, 0x84 })); // je target
+        emit({ 0x48, 0xB9 }); // mov rcx, imm64
+        emit64(Value(true).bits);
+        emit({ 0x48, 0x39, 0xC8 }); // cmp rax, rcx
+        const size_t truthy = jump({ 0x0F, 0x84 }); // je next
+        emit({ 0x48, 0x89, 0xC7 }); // mov rdi, rax
+        emit({ 0x48, 0xB8 }); // mov rax, imm64
+        emit64(reinterpret_cast<uint64_t>(&Jit::isTruthy));
+        emit({ 0xFF, 0xD0 }); // call rax
+        emit({ 0x84, 0xC0 }); // test al, al
+        taken.push_back(jump({ 0x0F, 0x84 })); // jz target
+        bind(truthy, code.size());
+        return taken;
+    }
+
+private:
+    void pushRax()
+    {
+        emit({ 0x49, 0x89, 0x06 }); // mov [r14], rax
+        emit({ 0x49, 0x83, 0xC6, 0x08 }); // add r14, 8
+    }
+
+    // Leaves a in xmm0/rax, b in xmm1/rdx and QNAN in rcx; returns the branches taken for non-numbers.
+    std::vector<size_t> loadNumberOperands()
+    {
+        std::vector<size_t> slow;
+        emit({ 0x49, 0x8B, 0x46, 0xF0 }); // mov rax, [r14 - 16]
+        emit({ 0x49, 0x8B, 0x56, 0xF8 }); // mov rdx, [r14 - 8]
+        emit({ 0x48, 0xB9 }); // mov rcx, imm64
+        emit64(Value::QNAN);
+        for (const uint8_t source : { 0xC0, 0xD0 }) {
+            emit({ 0x49, 0x89, source }); // mov r8, rax / rdx
+            emit({ 0x49, 0x21, 0xC8 }); // and r8, rcx
+            emit({ 0x49, 0x39, 0xC8 }); // cmp r8, rcx
+            slow.push_back(jump({ 0x0F, 0x84 })); // je slow
+        }
+        emit({ 0x66, 0x48, 0x0F, 0x6E, 0xC0 }); // movq xmm0, rax
+        emit({ 0x66, 0x48, 0x0F, 0x6E, 0xCA }); // movq xmm1, rdx
+        return slow;
+    }
+
+    void finishBinary()
+    {
+        emit({ 0x49, 0x89, 0x46, 0xF0 }); // mov [r14 - 16], rax
+        pop();
+    }
+
+    // Leaves the cell address in rax; returns the branch taken on a stale cache.
+    size_t loadGlobalCell(const InlineCache& cache)
+    {
+        static_assert(offsetof(InlineCache, version) == 0 && offsetof(InlineCache, cell) < 128);
+        emit({ 0x48, 0xB8 }); // mov rax, imm64
+        emit64(reinterpret_cast<uint64_t>(&cache));
+        emit({ 0x41, 0x8B, 0x0F }); // mov ecx, [r15]
+        emit({ 0x3B, 0x08 }); // cmp ecx, [rax]
+        const size_t slow = jump({ 0x0F, 0x85 }); // jne slow
+        emit({ 0x48, 0x8B, 0x40, static_cast<uint8_t>(offsetof(InlineCache, cell)) }); // mov rax, [rax + cell]
+        return slow;
+    }
+};
+
+bool Jit::compile(vMachine& vm, ObjFunction& function)
+{
+    if (!function.isVerified) {
+        return false;
+    }
+    const auto& code = function.chunk.code;
+    const auto& pool = function.chunk.pool;
+    const auto step = reinterpret_cast<uint64_t>(&Jit::step);
+
+    Assembler a;
+    std::vector<size_t> labels(code.size());
+    std::vector<std::pair<size_t, size_t>> branches; // rel32 field, bytecode target
+    a.prologue();
+
+    for (size_t offset = 0; offset < code.size();) {
+        labels[offset] = a.code.size();
+        const auto ip = reinterpret_cast<uint64_t>(&code[offset]);
+        const auto length = Verifier::lengthAt(function, offset);
+        if (!length) {
+            return false;
+        }
+        switch (cast(code[offset])) {
+        case OP_CODE::GET_LOCAL:
+            a.getLocal(code[offset + 1]);
+            break;
+        case OP_CODE::SET_LOCAL:
+            a.setLocal(code[offset + 1]);
+            break;
+        case OP_CODE::CONSTANT:
+            a.pushBits(pool[code[offset + 1]].bits);
+            break;
+        case OP_CODE::CONSTANT_LONG:
+            a.pushBits(pool[code[offset + 1] | (code[offset + 2] << 8) | (code[offset + 3] << 16)].bits);
+            break;
+        case OP_CODE::NIL:
+            a.pushBits(Value().bits);
+            break;
+        case OP_CODE::TRUE:
+            a.pushBits(Value(true).bits);
+            break;
+        case OP_CODE::FALSE:
+            a.pushBits(Value(false).bits);
+            break;
+        case OP_CODE::POP:
+            a.pop();
+            break;
+        case OP_CODE::ADD:
+            a.interpretOnSlowPath(a.arithmetic(0x58), ip);
+            break;
+        case OP_CODE::MULT:
+            a.interpretOnSlowPath(a.arithmetic(0x59), ip);
+            break;
+        case OP_CODE::GREATER:
+            a.interpretOnSlowPath(a.compare(0x97, false, false), ip); // seta
+            break;
+        case OP_CODE::GREATER_EQUAL:
+            a.interpretOnSlowPath(a.compare(0x93, false, false), ip); // setae
+            break;
+        case OP_CODE::LESS:
+            a.interpretOnSlowPath(a.compare(0x97, true, false), ip);
+            break;
+        case OP_CODE::LESS_EQUAL:
+            a.interpretOnSlowPath(a.compare(0x93, true, false), ip);
+            break;
+        case OP_CODE::EQUAL:
+            a.interpretOnSlowPath(a.compare(0x94, false, true), ip); // sete
+            break;
+        case OP_CODE::NEG:
+            a.interpretOnSlowPath(a.negate(), ip);
+            break;
+        case OP_CODE::GET_GLOBAL:
+            a.interpretOnSlowPath(a.getGlobal(function.chunk.cacheAt(offset)), ip);
+            break;
+        case OP_CODE::SET_GLOBAL:
+            a.interpretOnSlowPath(a.setGlobal(function.chunk.cacheAt(offset)), ip);
+            break;
+        case OP_CODE::JUMP: {
+            const auto jump = static_cast<int16_t>((code[offset + 1] << 8) | code[offset + 2]);
+            branches.emplace_back(a.jump({ 0xE9 }), offset + 3 + jump);
+            break;
+        }
+        case OP_CODE::LOOP: {
+            const uint16_t jump = (code[offset + 1] << 8) | code[offset + 2];
+            branches.emplace_back(a.jump({ 0xE9 }), offset + 3 - jump);
+            break;
+        }
+        case OP_CODE::JUMP_IF_FALSE: {
+            const auto jump = static_cast<int16_t>((code[offset + 1] << 8) | code[offset + 2]);
+            for (const size_t at : a.jumpIfFalse()) {
+                branches.emplace_back(at, offset + 3 + jump);
+            }
+            break;
+        }
+        case OP_CODE::CALL:
+            a.callHelper(reinterpret_cast<uint64_t>(&Jit::call), ip);
+            break;
+        case OP_CODE::MATH_SQRT:
+        case OP_CODE::MATH_ABS:
+        case OP_CODE::MATH_FLOOR:
+        case OP_CODE::MATH_CEIL:
+        case OP_CODE::MATH_ROUND:
+        case OP_CODE::MATH_POW:
+            a.callHelper(reinterpret_cast<uint64_t>(&Jit::math), ip);
+            break;
+        case OP_CODE::RETURN:
+            a.callHelper(reinterpret_cast<uint64_t>(&Jit::ret), 0);
+            a.emit({ 0xB0, 0x01 }); // mov al, 1
+            a.epilogue();
+            break;
+        default:
+            // No template: hand this one instruction to the interpreter.
+            a.callHelper(step, ip);
+            break;
+        }
+        offset += *length;
+    }
+
+    const size_t failure = a.code.size();
+    a.emit({ 0x31, 0xC0 }); // xor eax, eax
+    a.epilogue();
+    for (const size_t at : a.failures) {
+        a.bind(at, failure);
+    }
+    for (const auto& [at, target] : branches) {
+        a.bind(at, labels[target]);
+    }
+
+    function.jitCode = a.install();
+    if (function.jitCode) {
+        vm.jitStats.functionsCompiled++;
+    }
+    return static_cast<bool>(function.jitCode);
+}
+
+bool Jit::backEdge(vMachine& vm, InlineCache& cache)
+{
+    if (!cache.trace) {
+        std::vector<TraceStep> steps;
+        if (!record(vm, steps)) {
+            return false;
+        }
+        if (!steps.empty()) {
+            cache.trace = compileTrace(*vm.frames.back().closure->pFunction, steps);
+        }
+        if (!cache.trace) {
+            cache.traceAborted = true;
+            vm.jitStats.tracesAborted++;
+            return true;
+        }
+        vm.jitStats.tracesCompiled++;
+    }
+    // Recording stops on the back-edge, so the frame is at the loop header either way.
+    vm.jitStats.tracesExecuted++;
+    CallFrame& frame = vm.frames.back();
+    const uint8_t* resume = reinterpret_cast<TraceEntry>(cache.trace.get())(&vm.stack[frame.stackOffset], &vm, vm.stack.topAddress(), &vm.globalsVersion);
+    if (!resume) {
+        return false;
+    }
+    frame.ip = resume;
+    return true;
+}
+
+bool Jit::record(vMachine& vm, std::vector<TraceStep>& steps)
+{
+    CallFrame& frame = vm.frames.back();
+    const uint8_t* code = frame.closure->pFunction->chunk.code.data();
+    const uint8_t* header = frame.ip;
+    while (true) {
+        const uint8_t* ip = frame.ip;
+        const Value* top = vm.stack.end();
+        TraceStep step { static_cast<size_t>(ip - code) };
+        switch (cast(*ip)) {
+        case OP_CODE::ADD:
+        case OP_CODE::MULT:
+        case OP_CODE::GREATER:
+        case OP_CODE::GREATER_EQUAL:
+        case OP_CODE::LESS:
+        case OP_CODE::LESS_EQUAL:
+        case OP_CODE::EQUAL:
+            step.numbers = top[-1].isNumber() && top[-2].isNumber();
+            break;
+        case OP_CODE::NEG:
+            step.numbers = top[-1].isNumber();
+            break;
+        case OP_CODE::JUMP_IF_FALSE:
+            step.truthy = top[-1].isTruthy();
+            break;
+        case OP_CODE::LOOP:
+            // A nested loop's back-edge: the inner loop gets a trace of its own instead.
+            if (ip + 3 - ((ip[1] << 8) | ip[2]) != header) {
+                steps.clear();
+                return true;
+            }
+            steps.push_back(step);
+            return vm.step(ip);
+        case OP_CODE::CALL:
+        case OP_CODE::RETURN:
+            steps.clear();
+            return true;
+        default:
+            break;
+        }
+        if (steps.size() == MAX_TRACE_LENGTH) {
+            steps.clear();
+            return true;
+        }
+        steps.push_back(step);
+        if (!(isMath(*ip) ? math(&vm, ip) : vm.step(ip))) {
+            return false;
+        }
+    }
+}
+
+MachineCode Jit::compileTrace(ObjFunction& function, const std::vector<TraceStep>& steps)
+{
+    const auto& code = function.chunk.code;
+    const auto& pool = function.chunk.pool;
+
+    Assembler a;
+    std::vector<std::pair<size_t, const uint8_t*>> exits; // rel32 field, bytecode to resume at
+    a.prologue();
+    const size_t loop = a.code.size();
+
+    for (const TraceStep& s : steps) {
+        const uint8_t* ip = &code[s.offset];
+        const auto address = reinterpret_cast<uint64_t>(ip);
+        // Operations recorded with numbers leave the trace for anything else; the rest keep their fallback.
+        const auto specialise = [&](const std::vector<size_t>& slow) {
+            if (!s.numbers) {
+                a.interpretOnSlowPath(slow, address);
+                return;
+            }
+            for (const size_t at : slow) {
+                exits.emplace_back(at, ip);
+            }
+        };
+        switch (cast(*ip)) {
+        case OP_CODE::GET_LOCAL:
+            a.getLocal(ip[1]);
+            break;
+        case OP_CODE::SET_LOCAL:
+            a.setLocal(ip[1]);
+            break;
+        case OP_CODE::CONSTANT:
+            a.pushBits(pool[ip[1]].bits);
+            break;
+        case OP_CODE::CONSTANT_LONG:
+            a.pushBits(pool[ip[1] | (ip[2] << 8) | (ip[3] << 16)].bits);
+            break;
+        case OP_CODE::NIL:
+            a.pushBits(Value().bits);
+            break;
+        case OP_CODE::TRUE:
+            a.pushBits(Value(true).bits);
+            break;
+        case OP_CODE::FALSE:
+            a.pushBits(Value(false).bits);
+            break;
+        case OP_CODE::POP:
+            a.pop();
+            break;
+        case OP_CODE::ADD:
+            specialise(a.arithmetic(0x58));
+            break;
+        case OP_CODE::MULT:
+            specialise(a.arithmetic(0x59));
+            break;
+        case OP_CODE::GREATER:
+            specialise(a.compare(0x97, false, false));
+            break;
+        case OP_CODE::GREATER_EQUAL:
+            specialise(a.compare(0x93, false, false));
+            break;
+        case OP_CODE::LESS:
+            specialise(a.compare(0x97, true, false));
+            break;
+        case OP_CODE::LESS_EQUAL:
+            specialise(a.compare(0x93, true, false));
+            break;
+        case OP_CODE::EQUAL:
+            specialise(a.compare(0x94, false, true));
+            break;
+        case OP_CODE::NEG:
+            specialise(a.negate());
+            break;
+        case OP_CODE::GET_GLOBAL:
+            a.interpretOnSlowPath(a.getGlobal(function.chunk.cacheAt(s.offset)), address);
+            break;
+        case OP_CODE::SET_GLOBAL:
+            a.interpretOnSlowPath(a.setGlobal(function.chunk.cacheAt(s.offset)), address);
+            break;
+        case OP_CODE::JUMP:
+            // The trace is laid out in execution order, so unconditional jumps vanish.
+            break;
+        case OP_CODE::JUMP_IF_FALSE: {
+            const uint8_t* target = ip + 3 + static_cast<int16_t>((ip[1] << 8) | ip[2]);
+            const std::vector<size_t> falsey = a.jumpIfFalse();
+            if (s.truthy) {
+                for (const size_t at : falsey) {
+                    exits.emplace_back(at, target);
+                }
+            } else {
+                exits.emplace_back(a.jump({ 0xE9 }), ip + 3);
+                for (const size_t at : falsey) {
+                    a.bind(at, a.code.size());
+                }
+            }
+            break;
+        }
+        case OP_CODE::LOOP:
+            a.bind(a.jump({ 0xE9 }), loop);
+            break;
+        case OP_CODE::MATH_SQRT:
+        case OP_CODE::MATH_ABS:
+        case OP_CODE::MATH_FLOOR:
+        case OP_CODE::MATH_CEIL:
+        case OP_CODE::MATH_ROUND:
+        case OP_CODE::MATH_POW:
+            a.callHelper(reinterpret_cast<uint64_t>(&Jit::math), address);
+            break;
+        default:
+            a.callHelper(reinterpret_cast<uint64_t>(&Jit::step), address);
+            break;
+        }
+    }
+
+    const size_t failure = a.code.size();
+    a.emit({ 0x31, 0xC0 }); // xor eax, eax
+    a.epilogue();
+    for (const size_t at : a.failures) {
+        a.bind(at, failure);
+    }
+    for (const auto& [at, resume] : exits) {
+        a.bind(at, a.code.size());
+        a.syncTop();
+        a.emit({ 0x48, 0xB8 }); // mov rax, imm64
+        a.emit64(reinterpret_cast<uint64_t>(resume));
+        a.epilogue();
+    }
+    return a.install();
+}
+
+bool Jit::isTruthy(const uint64_t bits)
+{
+    Value value;
+    value.bits = bits;
+    return value.isTruthy();
+}
+
+#else
+
+// Only ahead-of-time compiled code exists, and it is not mapped.
+void MachineCode::release()
+{
+}
+
+bool Jit::compile(vMachine&, ObjFunction&)
+{
+    return false;
+}
+
+bool Jit::backEdge(vMachine&, InlineCache&)
+{
+    return true;
+}
+
+#endif
+
+bool Jit::enter(vMachine& vm)
+{
+    const CallFrame& frame = vm.frames.back();
+    const auto entry = reinterpret_cast<Entry>(frame.closure->pFunction->jitCode.get());
+    return entry(&vm.stack[frame.stackOffset], &vm, vm.stack.topAddress(), &vm.globalsVersion);
+}
+
+bool Jit::step(vMachine* vm, const uint8_t* ip)
+{
+    return vm->step(ip);
+}
+
+bool Jit::call(vMachine* vm, const uint8_t* ip)
+{
+    vm->frames.back().ip = ip + 2;
+    const int argCount = ip[1];
+    Chunk& chunk = vm->frames.back().closure->pFunction->chunk;
+    const size_t depth = vm->frames.size();
+    if (!vm->callCached(vm->stack.end()[-1 - argCount], argCount, chunk.cacheAt(ip - chunk.code.data()))) {
+        return false;
+    }
+    return vm->frames.size() == depth || vm->runCallee();
+}
+
+bool Jit::math(vMachine* vm, const uint8_t* ip)
+{
+    const auto op = static_cast<OP_CODE>(*ip);
+    const int argCount = op == OP_CODE::MATH_POW ? 2 : 1;
+    vm->frames.back().ip = ip + 1;
+    if (vMachine::intrinsic(op, vm->stack.end() - argCount)) {
+        vm->stack.resize(vm->stack.size() - argCount);
+        return true;
+    }
+    Chunk& chunk = vm->frames.back().closure->pFunction->chunk;
+    const size_t depth = vm->frames.size();
+    if (!vm->callCached(vm->stack.end()[-1 - argCount], argCount, chunk.cacheAt(ip - chunk.code.data()))) {
+        return false;
+    }
+    return vm->frames.size() == depth || vm->runCallee();
+}
+
+bool Jit::ret(vMachine* vm)
+{
+    vm->popFrame();
+    return true;
+}
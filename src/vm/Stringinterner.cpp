@@ -1,14 +1,126 @@
 
 #include "Stringinterner.h"
+#include "Heap.h"
+#include <algorithm>
+#include <bit>
+#include <utility>
 
-const std::string* StringInterner::find(const std::string& s) const
+size_t StringInterner::probe(const std::string_view chars, const uint32_t hash) const
 {
-    const auto it = pool.find(s);
-    return it != pool.end() ? &(*it) : nullptr;
+    const size_t mask = entries.size() - 1;
+    size_t reusable = entries.size();
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        const Entry& entry = entries[i];
+        if (entry.string == nullptr) {
+            if (!entry.tombstone) {
+                return reusable != entries.size() ? reusable : i;
+            }
+            reusable = std::min(reusable, i);
+        } else if (entry.hash == hash && entry.string->view() == chars) {
+            return i;
+        }
+    }
 }
 
-const std::string* StringInterner::intern(const std::string& s)
+// Rehashes into a table at most half full, dropping the tombstones.
+void StringInterner::grow()
 {
-    auto [it, inserted] = pool.insert(s);
-    return &(*it);
+    const size_t capacity = std::max(MIN_CAPACITY, std::bit_ceil((count + 1) * 2));
+    const std::vector<Entry> previous = std::exchange(entries, std::vector<Entry>(capacity));
+    tombstones = 0;
+    for (const Entry& entry : previous) {
+        if (entry.string == nullptr) {
+            continue;
+        }
+        size_t i = entry.hash & (capacity - 1);
+        while (entries[i].string != nullptr) {
+            i = (i + 1) & (capacity - 1);
+        }
+        entries[i] = entry;
+    }
+}
+
+ObjString* StringInterner::find(const std::string_view chars) const
+{
+    std::lock_guard lock { mutex };
+    return entries.empty() ? nullptr : entries[probe(chars, hashString(chars))].string;
+}
+
+ObjString* StringInterner::intern(const std::string_view chars)
+{
+    const uint32_t hash = hashString(chars);
+    {
+        std::lock_guard lock { mutex };
+        if (!entries.empty()) {
+            if (ObjString* s = entries[probe(chars, hash)].string) {
+                return s;
+            }
+        }
+    }
+    ObjString* s = Heap::instance().allocateString(chars);
+    s->cachedHash = hash;
+    std::lock_guard lock { mutex };
+    if ((count + tombstones + 1) * 4 > entries.size() * 3) {
+        grow();
+    }
+    Entry& entry = entries[probe(chars, hash)];
+    if (entry.string != nullptr) {
+        // Another thread interned it meanwhile; `s` is left to the collector.
+        return entry.string;
+    }
+    tombstones -= entry.tombstone;
+    entry = { s, hash, false };
+    count++;
+    return s;
+}
+
+// No lock: collections wait while worker threads compile, so nothing interns concurrently.
+void StringInterner::remove(const ObjString* s)
+{
+    // Interned strings are hashed; an unhashed one was made at run time.
+    if (entries.empty() || s->cachedHash == 0) {
+        return;
+    }
+    const size_t mask = entries.size() - 1;
+    for (size_t i = s->cachedHash & mask;; i = (i + 1) & mask) {
+        Entry& entry = entries[i];
+        if (entry.string == s) {
+            entry = { nullptr, 0, true };
+            count--;
+            tombstones++;
+            return;
+        }
+        if (entry.string == nullptr && !entry.tombstone) {
+            return;
+        }
+    }
+}
+
+void StringInterner::removeUnmarked()
+{
+    for (Entry& entry : entries) {
+        if (entry.string != nullptr && !entry.string->marked) {
+            entry = { nullptr, 0, true };
+            count--;
+            tombstones++;
+        }
+    }
+}
+
+InternStats StringInterner::stats() const
+{
+    std::lock_guard lock { mutex };
+    InternStats stats { count, entries.size(), tombstones };
+    size_t totalProbe = 0;
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (entries[i].string != nullptr) {
+            const size_t distance = (i - entries[i].hash) & (entries.size() - 1);
+            totalProbe += distance;
+            stats.maxProbe = std::max(stats.maxProbe, distance);
+        }
+    }
+    if (count != 0) {
+        stats.meanProbe = static_cast<double>(totalProbe) / static_cast<double>(count);
+    }
+    return stats;
 }
@@ -1,49 +1,159 @@
 #include "Value.h"
 #include "Object.h"
-#include "Stringinterner.h"
+#include "Heap.h"
 #include "Visit.h"
+#include <algorithm>
 #include <cstddef>
+#include <cstring>
 #include <format>
 #include <iostream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <variant>
 
+// Concatenations at least this long make a rope; shorter ones are copied, since a rope node
+// and its pieces would take more room than the characters.
+static constexpr size_t MIN_ROPE_LENGTH = 256;
+// The most room a fresh tail buffer gets, into which shorter pieces are appended (see append).
+static constexpr size_t TAIL_CAPACITY = 4 * MIN_ROPE_LENGTH;
+
+// The characters of a string or rope, flattening a rope the first time. The object must be
+// reachable by the collector, since flattening allocates.
+static const ObjString& flatten(Obj* string)
+{
+    if (const auto* s = string->asIf<ObjString>()) {
+        return *s;
+    }
+    auto& rope = string->as<ObjRope>();
+    if (rope.right == nullptr) {
+        return rope.left->as<ObjString>();
+    }
+    ObjString* flat = Heap::instance().allocateString(rope.length);
+    rope.copyTo(flat->data());
+    rope.left = flat;
+    rope.right = nullptr;
+    rope.ownsTail = false;
+    if (Heap::needsBarrier(flat)) {
+        Heap::instance().rememberRope(rope);
+    }
+    return *flat;
+}
+
+// A rope of `rope`, which the collector can reach, followed by `chars`, fewer than
+// MIN_ROPE_LENGTH of them. They go into a tail buffer: the newest rope over one with room
+// copies them in place, and the rope it makes shares its `left`. Each append then leaves the
+// previous rope node to be collected, rather than keeping one live node per piece. Only ropes
+// start a buffer, and at half their length, so a one-off append does not pay for room to grow.
+static Value append(ObjRope& rope, const std::string_view chars)
+{
+    const auto length = static_cast<uint32_t>(rope.length + chars.size());
+    if (rope.ownsTail) {
+        auto& tail = rope.right->as<ObjString>();
+        const uint32_t used = rope.length - stringLength(*rope.left);
+        if (used + chars.size() <= tail.length) {
+            // Past `used`, no other rope reads the buffer.
+            std::memcpy(tail.data() + used, chars.data(), chars.size());
+            rope.ownsTail = false;
+            Obj* appended = Heap::instance().allocate(ObjRope(rope.left, &tail, length));
+            appended->as<ObjRope>().ownsTail = true;
+            return { appended };
+        }
+    }
+    // The new buffer is only held here while the rope is allocated.
+    const Heap::NoCollection pause;
+    const size_t capacity = std::min(std::max<size_t>(chars.size(), length / 2), TAIL_CAPACITY);
+    ObjString* tail = Heap::instance().allocateString(capacity);
+    std::memcpy(tail->data(), chars.data(), chars.size());
+    Obj* appended = Heap::instance().allocate(ObjRope(&rope, tail, length));
+    appended->as<ObjRope>().ownsTail = true;
+    return { appended };
+}
+
+// `a` and `b` are strings or ropes the collector can reach; they are on the VM stack. The
+// caller has checked that the result is at most MAX_STRING_LENGTH long.
+static Value concatenate(Obj* a, Obj* b)
+{
+    const size_t length = static_cast<size_t>(stringLength(*a)) + stringLength(*b);
+    if (length >= MIN_ROPE_LENGTH) {
+        const auto* piece = b->asIf<ObjString>();
+        if (auto* rope = a->asIf<ObjRope>(); rope != nullptr && piece != nullptr && piece->length < MIN_ROPE_LENGTH) {
+            return append(*rope, piece->view());
+        }
+        return { Heap::instance().allocate(ObjRope(a, b, static_cast<uint32_t>(length))) };
+    }
+    // Both are flat: a rope is longer than this.
+    const auto& sa = a->as<ObjString>();
+    const auto& sb = b->as<ObjString>();
+    ObjString* s = Heap::instance().allocateString(length);
+    std::memcpy(s->data(), sa.chars(), sa.length);
+    std::memcpy(s->data() + sa.length, sb.chars(), sb.length);
+    return { s };
+}
+
+// `chars`, which are not on the heap, before or after the string or rope `string`.
+static Value concatenate(Obj* string, const std::string_view chars, const bool charsFirst)
+{
+    if (stringLength(*string) + chars.size() >= MIN_ROPE_LENGTH) {
+        if (auto* rope = string->asIf<ObjRope>(); rope != nullptr && !charsFirst && chars.size() < MIN_ROPE_LENGTH) {
+            return append(*rope, chars);
+        }
+        // The new piece is only held here while the rope is allocated.
+        const Heap::NoCollection pause;
+        Obj* piece = Heap::instance().allocateString(chars);
+        return charsFirst ? concatenate(piece, string) : concatenate(string, piece);
+    }
+    const auto& s = string->as<ObjString>();
+    ObjString* result = Heap::instance().allocateString(s.length + chars.size());
+    std::memcpy(result->data() + (charsFirst ? 0 : s.length), chars.data(), chars.size());
+    std::memcpy(result->data() + (charsFirst ? chars.size() : 0), s.chars(), s.length);
+    return { result };
+}
+
+// `string` is a string or rope the collector can reach; the caller has checked that `times`
+// copies of it are at most MAX_STRING_LENGTH long.
+static Value repeat(Obj* string, const size_t times)
+{
+    const ObjString& s = flatten(string);
+    ObjString* result = Heap::instance().allocateString(s.length * times);
+    for (size_t i = 0; i < times; ++i) {
+        std::memcpy(result->data() + i * s.length, s.chars(), s.length);
+    }
+    return { result };
+}
+
 void Value::print() const
 {
-    std::visit(overloaded {
+    visit(overloaded {
                    [](double d) -> void { std::cout << std::format("{}", d); },
                    [](bool b) -> void { std::cout << (b ? "true" : "false"); },
                    [](nullptr_t) -> void { std::cout << "nil"; },
-                   [](Obj* obj) -> void { obj->print(); } },
-        as);
+                   [](Obj* obj) -> void { obj->print(); } });
 }
 
 ObjFunction* Value::asFunc() const
 {
-    return std::visit(overloaded {
+    return visit(overloaded {
                           [](Obj* obj) -> ObjFunction* {
-                              if (auto func = std::get_if<ObjFunction>(&obj->as)) {
+                              if (auto func = obj->asIf<ObjFunction>()) {
                                   return func;
                               }
                               throw std::runtime_error { std::format("Object cannot be converted to function because {} is not a function", obj->to_string()) };
                           },
                           [](auto) -> ObjFunction* {
                               throw std::runtime_error { "Value cannot be converted to function as value is not an object" };
-                          } },
-        as);
+                          } });
 }
 std::string Value::to_string() const
 {
-    return std::visit(overloaded {
+    return visit(overloaded {
                           [](double d) -> std::string { return std::format("{}", d); },
                           [](const bool b) -> std::string { return (b ? "true" : "false"); },
                           [](nullptr_t) -> std::string { return "nil"; },
                           [](const Obj* o) -> std::string {
                               return o->to_string();
                           },
-                      },
-        as);
+                      });
 }
 
 Value& Value::operator+=(const Value& other)
@@ -54,109 +164,84 @@ Value& Value::operator+=(const Value& other)
 
 Value Value::operator<(const Value& other) const
 {
-    return std::visit(overloaded {
+    return ::visit(overloaded {
                           [](double a, double b) -> Value { return { a < b }; },
                           [](const auto&, const auto&) -> Value {
                               throw std::runtime_error("Invalid operation: can only compare numbers");
                           } },
-        as, other.as);
+        *this, other);
 }
 
 Value Value::operator>=(const Value& other) const
 {
-    return std::visit(overloaded {
+    return ::visit(overloaded {
                           [](double a, double b) -> Value { return { a >= b }; },
                           [](const auto&, const auto&) -> Value {
                               throw std::runtime_error("Invalid operation: can only compare numbers");
                           } },
-        as, other.as);
+        *this, other);
 }
 
 bool Value::isTruthy() const
 {
-    return std::visit(overloaded {
+    return visit(overloaded {
                           [](double d) { return d != 0.0; },
                           [](bool b) { return b; },
                           [](nullptr_t) { return false; },
                           [](Obj* obj) {
-                              if (auto str = std::get_if<ObjString>(&obj->as)) {
-                                  return !str->str->empty();
-                              }
-                              return true;
-                          } },
-        as);
+                              return !isStringObj(*obj) || stringLength(*obj) != 0;
+                          } });
 }
 
 Value Value::operator+(const Value& other) const
 {
-    return std::visit(overloaded {
+    return ::visit(overloaded {
                           [](double a, double b) -> Value {
                               return { a + b };
                           },
                           [](Obj* a, Obj* b) -> Value {
-                              if (auto sa = std::get_if<ObjString>(&a->as)) {
-                                  if (auto sb = std::get_if<ObjString>(&b->as)) {
-                                      auto& interner = StringInterner::instance();
-                                      if (auto existing = interner.find(*sa->str + *sb->str)) {
-                                          return { new Obj(ObjString(existing)) };
-                                      }
-                                      const std::string* interned = interner.intern(*sa->str + *sb->str);
-                                      return { new Obj(ObjString(interned)) };
-                                  }
+                              if (isStringObj(*a) && isStringObj(*b)) {
+                                  return concatenate(a, b);
                               }
                               throw std::runtime_error("Can only concatenate string objects");
                           },
                           [](Obj* a, double b) -> Value {
-                              if (const auto sa = std::get_if<ObjString>(&a->as)) {
-                                  auto& interner = StringInterner::instance();
-                                  const std::string numStr = std::format("{:.6g}", b);
-                                  if (const auto existing = interner.find(*sa->str + numStr)) {
-                                      return { new Obj(ObjString(existing)) };
-                                  }
-                                  const std::string* interned = interner.intern(*sa->str + numStr);
-                                  return { new Obj(ObjString(interned)) };
+                              if (isStringObj(*a)) {
+                                  return concatenate(a, std::format("{:.6g}", b), false);
                               }
                               throw std::runtime_error("Can only concatenate string with number");
                           },
                           [](double a, Obj* b) -> Value {
-                              if (auto sb = std::get_if<ObjString>(&b->as)) {
-                                  auto& interner = StringInterner::instance();
-                                  std::string numStr = std::format("{:.6g}", a);
-                                  if (auto existing = interner.find(numStr + *sb->str)) {
-                                      return { new Obj(ObjString(existing)) };
-                                  }
-                                  const std::string* interned = interner.intern(numStr + *sb->str);
-                                  return { new Obj(ObjString(interned)) };
+                              if (isStringObj(*b)) {
+                                  return concatenate(b, std::format("{:.6g}", a), true);
                               }
                               throw std::runtime_error("Can only concatenate number with string");
                           },
                           [](const auto&, const auto&) -> Value {
                               throw std::runtime_error("Invalid operation: can only add numbers or concatenate strings");
                           } },
-        as, other.as);
+        *this, other);
 }
 
 Value Value::operator==(const Value& other) const
 {
-    return std::visit(overloaded {
+    return ::visit(overloaded {
                           [](double a, double b) -> Value { return { a == b }; },
                           [](bool a, bool b) -> Value { return { a == b }; },
                           [](nullptr_t, nullptr_t) -> Value { return { true }; },
                           [](Obj* a, Obj* b) -> Value {
-                              return std::visit(overloaded {
-                                                    [](const ObjString& sa, const ObjString& sb) -> Value {
-                                                        return { sa.str == sb.str };
-                                                    },
-                                                    [](const auto&, const auto&) -> Value { return { false }; } },
-                                  a->as, b->as);
+                              if (!isStringObj(*a) || !isStringObj(*b) || stringLength(*a) != stringLength(*b)) {
+                                  return { false };
+                              }
+                              return { flatten(a) == flatten(b) };
                           },
                           [](const auto&, const auto&) -> Value { return { false }; } },
-        as, other.as);
+        *this, other);
 }
 
 Value& Value::operator/=(const Value& other)
 {
-    as = std::visit(overloaded {
+    *this = ::visit(overloaded {
                         [](double a, double b) -> Value {
                             if (b == 0)
                                 throw std::runtime_error("Division by zero");
@@ -165,117 +250,84 @@ Value& Value::operator/=(const Value& other)
                         [](const auto&, const auto&) -> Value {
                             throw std::runtime_error("Invalid operation: can only divide numbers");
                         } },
-        as, other.as)
-             .as;
+        *this, other);
     return *this;
 }
 
 Value Value::operator-() const
 {
-    return std::visit(overloaded {
+    return visit(overloaded {
                           [](double a) -> Value { return { -a }; },
                           [](const auto&) -> Value {
                               throw std::runtime_error("Invalid operation: can only negate numbers");
-                          } },
-        as);
+                          } });
 }
 
 Value Value::operator!() const
 {
-    return std::visit(overloaded {
+    return visit(overloaded {
                           [](double) { return Value(false); },
                           [](bool b) { return Value(!b); },
                           [](nullptr_t) { return Value(true); },
-                          [](Obj*) { return Value(false); } },
-        as);
+                          [](Obj*) { return Value(false); } });
 }
 
 Value Value::operator-(const Value& other) const
 {
-    return std::visit(overloaded {
+    return ::visit(overloaded {
                           [](double a, double b) -> Value { return { a - b }; },
                           [](const auto&, const auto&) -> Value {
                               throw std::runtime_error("Invalid operation: can only subtract numbers");
                           } },
-        as, other.as);
+        *this, other);
 }
 
 Value Value::operator>(const Value& other) const
 {
-    return std::visit(overloaded {
+    return ::visit(overloaded {
                           [](double a, double b) -> Value { return { a > b }; },
                           [](const auto&, const auto&) -> Value {
                               throw std::runtime_error("Invalid operation: can only compare numbers");
                           } },
-        as, other.as);
+        *this, other);
 };
 
 bool Value::isString() const
 {
-    return std::visit(overloaded {
-                          [](Obj* obj) { return std::holds_alternative<ObjString>(obj->as); },
-                          [](const auto&) { return false; } },
-        as);
-}
-
-bool Value::isNumber() const
-{
-    return std::visit(overloaded {
-                          [](double) { return true; },
-                          [](const auto&) { return false; } },
-        as);
+    return visit(overloaded {
+                          [](Obj* obj) { return isStringObj(*obj); },
+                          [](const auto&) { return false; } });
 }
 
 double Value::asNumber() const
 {
-    return std::visit(overloaded {
-                          [](double d) { return d; },
-                          [](const auto&) -> double { throw std::runtime_error("Value is not a number"); } },
-        as);
+    if (!isNumber()) {
+        throw std::runtime_error("Value is not a number");
+    }
+    return asNumberUnchecked();
 }
 
 Value Value::operator*(const Value& other) const
 {
-    return std::visit(overloaded {
+    return ::visit(overloaded {
                           [](double a, double b) -> Value { return { a * b }; },
+                          // The count is a whole number in range; vMachine::mult checks.
                           [](Obj* a, double b) -> Value {
-                              if (auto sa = std::get_if<ObjString>(&a->as)) {
-                                  int repeat = static_cast<int>(b);
-                                  if (repeat < 0) {
-                                      throw std::runtime_error("Cannot multiply string by negative number");
-                                  }
-                                  std::string result;
-                                  result.reserve(sa->str->length() * repeat);
-                                  for (int i = 0; i < repeat; ++i) {
-                                      result += *sa->str;
-                                  }
-                                  auto& interner = StringInterner::instance();
-                                  const std::string* interned = interner.intern(result);
-                                  return { new Obj(ObjString(interned)) };
+                              if (isStringObj(*a)) {
+                                  return repeat(a, static_cast<size_t>(b));
                               }
                               throw std::runtime_error("Can only multiply string by number");
                           },
                           [](double a, Obj* b) -> Value {
-                              if (auto sb = std::get_if<ObjString>(&b->as)) {
-                                  int repeat = static_cast<int>(a);
-                                  if (repeat < 0) {
-                                      throw std::runtime_error("Cannot multiply string by negative number");
-                                  }
-                                  std::string result;
-                                  result.reserve(sb->str->length() * repeat);
-                                  for (int i = 0; i < repeat; ++i) {
-                                      result += *sb->str;
-                                  }
-                                  auto& interner = StringInterner::instance();
-                                  const std::string* interned = interner.intern(result);
-                                  return { new Obj(ObjString(interned)) };
+                              if (isStringObj(*b)) {
+                                  return repeat(b, static_cast<size_t>(a));
                               }
                               throw std::runtime_error("Can only multiply string by number");
                           },
                           [](const auto&, const auto&) -> Value {
                               throw std::runtime_error("Invalid operation: can only multiply numbers or string by number");
                           } },
-        as, other.as);
+        *this, other);
 }
 
 Value Value::operator*=(const Value& other)
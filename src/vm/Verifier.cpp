@@ -0,0 +1,327 @@
+#include "Verifier.h"
+#include "Instructions.h"
+#include <algorithm>
+#include <variant>
+
+bool Verifier::verify(ObjFunction& function)
+{
+    Verifier verifier { function };
+    function.isVerified = verifier.run();
+    function.maxStackDepth = function.isVerified ? verifier.maxDepth : 0;
+
+    for (const auto& constant : function.chunk.pool) {
+        if (constant.isObj()) {
+            if (auto* nested = constant.asObj()->asIf<ObjFunction>(); nested && nested->declaration == nullptr) {
+                // An unverified parent proves nothing about its frame.
+                if (!function.isVerified) {
+                    nested->enclosingSlots = 0;
+                    nested->enclosingUpvalues = 0;
+                }
+                verify(*nested);
+            }
+        }
+    }
+    return function.isVerified;
+}
+
+std::optional<size_t> Verifier::lengthAt(const ObjFunction& function, const size_t offset)
+{
+    return Verifier { function }.instructionLength(offset);
+}
+
+ObjFunction* Verifier::functionConstant(const size_t index) const
+{
+    if (index >= chunk.pool.size()) {
+        return nullptr;
+    }
+    if (chunk.pool[index].isObj()) {
+        return chunk.pool[index].asObj()->asIf<ObjFunction>();
+    }
+    return nullptr;
+}
+
+std::optional<size_t> Verifier::instructionLength(const size_t offset) const
+{
+    const auto& code = chunk.code;
+    switch (cast(code[offset])) {
+    case OP_CODE::CONSTANT:
+    case OP_CODE::DEFINE_GLOBAL:
+    case OP_CODE::SET_GLOBAL:
+    case OP_CODE::GET_GLOBAL:
+        if (offset + 1 >= code.size() || code[offset + 1] >= chunk.pool.size()) {
+            return std::nullopt;
+        }
+        return 2;
+    case OP_CODE::CONSTANT_LONG: {
+        if (offset + 3 >= code.size()) {
+            return std::nullopt;
+        }
+        const size_t index = code[offset + 1] | (code[offset + 2] << 8) | (code[offset + 3] << 16);
+        if (index >= chunk.pool.size()) {
+            return std::nullopt;
+        }
+        return 4;
+    }
+    case OP_CODE::GET_LOCAL:
+    case OP_CODE::SET_LOCAL:
+    case OP_CODE::CALL:
+    case OP_CODE::GET_UPVALUE:
+    case OP_CODE::SET_UPVALUE:
+    case OP_CODE::GET_ENCLOSING_LOCAL:
+    case OP_CODE::SET_ENCLOSING_LOCAL:
+    case OP_CODE::GET_ENCLOSING_UPVALUE:
+    case OP_CODE::SET_ENCLOSING_UPVALUE:
+        return 2;
+    case OP_CODE::JUMP:
+    case OP_CODE::JUMP_IF_FALSE:
+    case OP_CODE::LOOP:
+        return 3;
+    case OP_CODE::CLOSURE: {
+        if (offset + 1 >= code.size()) {
+            return std::nullopt;
+        }
+        const ObjFunction* nested = functionConstant(code[offset + 1]);
+        if (nested == nullptr) {
+            return std::nullopt;
+        }
+        return 2 + 2 * nested->upValueCount;
+    }
+    case OP_CODE::ADD:
+    case OP_CODE::MULT:
+    case OP_CODE::PRINT:
+    case OP_CODE::LESS_EQUAL:
+    case OP_CODE::GREATER_EQUAL:
+    case OP_CODE::POP:
+    case OP_CODE::SWAP:
+    case OP_CODE::DUP:
+    case OP_CODE::DIV:
+    case OP_CODE::NEG:
+    case OP_CODE::NIL:
+    case OP_CODE::TRUE:
+    case OP_CODE::FALSE:
+    case OP_CODE::EQUAL:
+    case OP_CODE::GREATER:
+    case OP_CODE::LESS:
+    case OP_CODE::NOT:
+    case OP_CODE::RETURN:
+    case OP_CODE::CLOSE_UPVALUE:
+    case OP_CODE::MATH_SQRT:
+    case OP_CODE::MATH_ABS:
+    case OP_CODE::MATH_FLOOR:
+    case OP_CODE::MATH_CEIL:
+    case OP_CODE::MATH_ROUND:
+    case OP_CODE::MATH_POW:
+        return 1;
+    }
+    return std::nullopt;
+}
+
+std::optional<std::vector<bool>> Verifier::decode() const
+{
+    std::vector<bool> starts(chunk.code.size(), false);
+    for (size_t offset = 0; offset < chunk.code.size();) {
+        const auto length = instructionLength(offset);
+        if (!length || offset + *length > chunk.code.size()) {
+            return std::nullopt;
+        }
+        starts[offset] = true;
+        offset += *length;
+    }
+    return starts;
+}
+
+bool Verifier::flow(const size_t target, const int height, const std::vector<bool>& starts)
+{
+    if (target >= starts.size() || !starts[target]) {
+        return false;
+    }
+    if (heights[target] == -1) {
+        heights[target] = height;
+        worklist.push_back(target);
+        return true;
+    }
+    return heights[target] == height;
+}
+
+bool Verifier::run()
+{
+    const auto starts = decode();
+    if (!starts || chunk.code.empty()) {
+        return false;
+    }
+
+    // Slot 0 holds the callee, followed by the arguments.
+    const int entryHeight = 1 + function.arity;
+    heights.assign(chunk.code.size(), -1);
+    heights[0] = entryHeight;
+    worklist.push_back(0);
+    maxDepth = entryHeight;
+
+    const auto& code = chunk.code;
+    while (!worklist.empty()) {
+        const size_t offset = worklist.back();
+        worklist.pop_back();
+        const int height = heights[offset];
+        const size_t next = offset + *instructionLength(offset);
+
+        int needs = 0;
+        int effect = 0;
+        switch (cast(code[offset])) {
+        case OP_CODE::CONSTANT:
+        case OP_CODE::CONSTANT_LONG:
+        case OP_CODE::NIL:
+        case OP_CODE::TRUE:
+        case OP_CODE::FALSE:
+        case OP_CODE::GET_GLOBAL:
+            effect = 1;
+            break;
+        case OP_CODE::ADD:
+        case OP_CODE::MULT:
+        case OP_CODE::DIV:
+        case OP_CODE::EQUAL:
+        case OP_CODE::GREATER:
+        case OP_CODE::LESS:
+        case OP_CODE::GREATER_EQUAL:
+        case OP_CODE::LESS_EQUAL:
+            needs = 2;
+            effect = -1;
+            break;
+        case OP_CODE::NEG:
+        case OP_CODE::NOT:
+        case OP_CODE::PRINT:
+        case OP_CODE::SET_GLOBAL:
+            needs = 1;
+            break;
+        case OP_CODE::POP:
+        case OP_CODE::CLOSE_UPVALUE:
+        case OP_CODE::DEFINE_GLOBAL:
+            needs = 1;
+            effect = -1;
+            break;
+        case OP_CODE::SWAP:
+            needs = 2;
+            break;
+        case OP_CODE::DUP:
+            needs = 1;
+            effect = 1;
+            break;
+        case OP_CODE::GET_LOCAL:
+            if (code[offset + 1] >= height) {
+                return false;
+            }
+            effect = 1;
+            break;
+        case OP_CODE::SET_LOCAL:
+            if (code[offset + 1] >= height) {
+                return false;
+            }
+            needs = 1;
+            break;
+        case OP_CODE::GET_UPVALUE:
+            if (code[offset + 1] >= function.upValueCount) {
+                return false;
+            }
+            effect = 1;
+            break;
+        case OP_CODE::SET_UPVALUE:
+            if (code[offset + 1] >= function.upValueCount) {
+                return false;
+            }
+            needs = 1;
+            break;
+        case OP_CODE::GET_ENCLOSING_LOCAL:
+            if (code[offset + 1] >= function.enclosingSlots) {
+                return false;
+            }
+            effect = 1;
+            break;
+        case OP_CODE::SET_ENCLOSING_LOCAL:
+            if (code[offset + 1] >= function.enclosingSlots) {
+                return false;
+            }
+            needs = 1;
+            break;
+        case OP_CODE::GET_ENCLOSING_UPVALUE:
+            if (code[offset + 1] >= function.enclosingUpvalues) {
+                return false;
+            }
+            effect = 1;
+            break;
+        case OP_CODE::SET_ENCLOSING_UPVALUE:
+            if (code[offset + 1] >= function.enclosingUpvalues) {
+                return false;
+            }
+            needs = 1;
+            break;
+        case OP_CODE::CALL:
+            needs = 1 + code[offset + 1];
+            effect = -code[offset + 1];
+            break;
+        case OP_CODE::MATH_SQRT:
+        case OP_CODE::MATH_ABS:
+        case OP_CODE::MATH_FLOOR:
+        case OP_CODE::MATH_CEIL:
+        case OP_CODE::MATH_ROUND:
+            needs = 2;
+            effect = -1;
+            break;
+        case OP_CODE::MATH_POW:
+            needs = 3;
+            effect = -2;
+            break;
+        case OP_CODE::CLOSURE: {
+            // The closure is pushed before it captures, so slot `height` (itself) is already there;
+            // and it only runs while this frame sits below it with at least that many slots.
+            const size_t slots = static_cast<size_t>(height) + 1;
+            for (size_t operand = offset + 2; operand < next; operand += 2) {
+                const bool isLocal = code[operand] != 0;
+                const uint8_t index = code[operand + 1];
+                if ((isLocal && index >= slots) || (!isLocal && index >= function.upValueCount)) {
+                    return false;
+                }
+            }
+            ObjFunction* nested = functionConstant(code[offset + 1]);
+            nested->enclosingSlots = nested->enclosingSlots == 0 ? slots : std::min(nested->enclosingSlots, slots);
+            nested->enclosingUpvalues = function.upValueCount;
+            effect = 1;
+            break;
+        }
+        case OP_CODE::RETURN:
+            if (height < 1) {
+                return false;
+            }
+            continue;
+        case OP_CODE::JUMP: {
+            const auto jump = static_cast<int16_t>((code[offset + 1] << 8) | code[offset + 2]);
+            if (!flow(next + jump, height, *starts)) {
+                return false;
+            }
+            continue;
+        }
+        case OP_CODE::JUMP_IF_FALSE: {
+            const auto jump = static_cast<int16_t>((code[offset + 1] << 8) | code[offset + 2]);
+            if (height < 1 || !flow(next + jump, height, *starts)) {
+                return false;
+            }
+            needs = 1;
+            break;
+        }
+        case OP_CODE::LOOP: {
+            const auto jump = static_cast<uint16_t>((code[offset + 1] << 8) | code[offset + 2]);
+            if (jump > next || !flow(next - jump, height, *starts)) {
+                return false;
+            }
+            continue;
+        }
+        }
+
+        if (height < needs) {
+            return false;
+        }
+        maxDepth = std::max(maxDepth, static_cast<size_t>(height + effect));
+        if (!flow(next, height + effect, *starts)) {
+            return false;
+        }
+    }
+    return true;
+}
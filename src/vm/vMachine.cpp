@@ -1,95 +1,191 @@
 #include "vMachine.h"
+#include "ByteCompiler.h"
+#include "Heap.h"
 #include "Instructions.h"
+#include "Jit.h"
 #include "Object.h"
 #include "Stringinterner.h"
+#include "Verifier.h"
 #include "Visit.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <cstdint>
 #include <ctime>
+#include <deque>
 #include <format>
 #include <iostream>
+#include <iterator>
 #include <ostream>
 #include <string>
 #include <variant>
-#define DEBUG_TRACE_EXECUTION
-size_t& vMachine::ip()
+
+// True when `callee` is the native implemented by `function`, i.e. a builtin nobody has replaced.
+static bool isBuiltin(const Value callee, const NativeFn function)
 {
-    return frames.back().ip;
+    if (!callee.isObj()) {
+        return false;
+    }
+    const auto* native = callee.asObj()->asIf<ObjNative>();
+    return native != nullptr && native->function == function;
 }
 
-Chunk& vMachine::instructions() const
+// Computes a MATH_* opcode in place of the call it replaces: args[-1] is the callee and
+// receives the result. Fails, touching nothing, unless the callee is still the builtin and
+// the operands are numbers the builtin would accept, so the caller can fall back to CALL.
+bool vMachine::intrinsic(const OP_CODE op, Value* args)
 {
-    if (frames.back().function != nullptr) {
-        return frames.back().function->chunk;
-    } else {
-        return frames.back().closure->pFunction->chunk;
+    if (!args[0].isNumber()) {
+        return false;
+    }
+    const double x = args[0].asNumberUnchecked();
+    const auto apply = [&](const NativeFn native, const bool accepted, auto compute) {
+        if (!accepted || !isBuiltin(args[-1], native)) {
+            return false;
+        }
+        args[-1] = Value(compute());
+        return true;
+    };
+    switch (op) {
+    case OP_CODE::MATH_SQRT:
+        return apply(sqrtNative, x >= 0, [x] { return std::sqrt(x); });
+    case OP_CODE::MATH_ABS:
+        return apply(absNative, true, [x] { return std::abs(x); });
+    case OP_CODE::MATH_FLOOR:
+        return apply(floorNative, true, [x] { return std::floor(x); });
+    case OP_CODE::MATH_CEIL:
+        return apply(ceilNative, true, [x] { return std::ceil(x); });
+    case OP_CODE::MATH_ROUND:
+        return apply(roundNative, true, [x] { return std::round(x); });
+    case OP_CODE::MATH_POW:
+        return apply(powNative, args[1].isNumber(), [x, args] { return std::pow(x, args[1].asNumberUnchecked()); });
+    default:
+        return false;
     }
 }
 
-void vMachine::runtimeError(const std::string& error)
+const uint8_t*& vMachine::ip()
 {
-    std::cerr << error << std::endl;
-    const size_t instruction = ip() - 1;
-    const int line = instructions().lines[instruction].lineNumber;
-    std::cerr << "[line " << line << "] in script\n";
-    resetStack();
+    return frames.back().ip;
 }
 
-void vMachine::defineNative(const std::string& name, NativeFn function)
+ObjFunction* vMachine::currentFunction() const
 {
-    auto internedName = StringInterner::instance().intern(name);
-    auto nativeObj = new Obj(ObjNative(std::move(function)));
-    globals[*internedName] = Value(nativeObj);
+    return frames.back().closure->pFunction;
 }
 
-int16_t vMachine::readShort()
+Chunk& vMachine::instructions() const
 {
-    uint8_t high = instructions().code[ip()];
-    uint8_t low = instructions().code[ip() + 1];
-    ip() += 2;
-    int16_t result = (high << 8) | low;
-    return result;
+    return frames.back().closure->pFunction->chunk;
 }
 
-Value vMachine::readConstant()
+void vMachine::runtimeError(const vError code, const std::string& message)
 {
-    if (ip() > 255)
-        return readConstantLong();
-    return instructions().pool[instructions().code[ip()++]];
+    state = vState::BAD;
+    error = code;
+    std::cerr << message << std::endl;
+    const size_t instruction = ip() - instructions().code.data() - 1;
+    const int line = instructions().lines[instruction].lineNumber;
+    std::cerr << "[line " << line << "] in script\n";
+    resetStack();
 }
 
-Value vMachine::readConstantLong()
+uint32_t vMachine::newGlobalsVersion()
 {
-    const uint32_t index = instructions().code[ip()] | (instructions().code[ip() + 1] << 8) | (instructions().code[ip() + 2] << 16);
-    ip() += 3;
-    return instructions().pool[index];
+    // Starts above 0, the version of an empty cache.
+    static std::atomic<uint32_t> last { 0 };
+    return ++last;
 }
 
-class StackUnderflowError final : public std::runtime_error {
-public:
-    explicit StackUnderflowError(const std::string& opcode)
-        : std::runtime_error(std::format("Stack underflow occurred during {} operation", opcode))
-    {
+void vMachine::defineNative(const NativeSpec& native)
+{
+    // The name and the native would otherwise be unreachable while the other is allocated.
+    const Heap::NoCollection pause;
+    globals[StringInterner::instance().intern(native.name)] = Value(Heap::instance().allocate(ObjNative(native)));
+    globalsVersion = newGlobalsVersion();
+    globalsDirty = true;
+}
+
+void vMachine::defineNativeFunctions()
+{
+    // Natives hold no per-VM state, so every VM and every load() shares one object per entry.
+    static std::deque<ObjNative> objects = [] {
+        std::deque<ObjNative> objects;
+        for (const NativeSpec& native : nativeTable) {
+            // Not on the heap, so never young.
+            objects.emplace_back(native).old = true;
+        }
+        return objects;
+    }();
+    // The names may be young, and a minor collection would skip them until the card is set.
+    const Heap::NoCollection pause;
+    for (size_t i = 0; i < std::size(nativeTable); i++) {
+        globals[StringInterner::instance().intern(nativeTable[i].name)] = Value(&objects[i]);
     }
-};
+    globalsVersion = newGlobalsVersion();
+    globalsDirty = true;
+}
 
-void vMachine::ensureStackSize(size_t size, const char* opcode) const
+vMachine::~vMachine()
 {
-    if (stack.size() < size) {
-        throw StackUnderflowError(opcode);
+    Heap::instance().removeRoots(this);
+    // The script is not on the heap, so its native code goes here; collecting frees the other
+    // functions only this VM kept alive, and theirs with them.
+    if (script != nullptr) {
+        script->jitCode = {};
+        for (InlineCache& cache : script->chunk.caches) {
+            cache.trace = {};
+        }
     }
+    Heap::instance().collect();
 }
 
-uint8_t vMachine::readByte()
+void vMachine::markRoots(Heap& heap)
 {
-    return instructions().code[ip()++];
+    for (const Value& value : stack) {
+        heap.markValue(value);
+    }
+    // A frame's closure is in its slot 0 already; this covers the code and upvalues it uses directly.
+    for (const CallFrame& frame : frames) {
+        heap.markChunk(frame.closure->pFunction->chunk);
+        for (ObjUpvalue* upvalue : frame.closure->upValues) {
+            heap.markUpvalue(upvalue);
+        }
+    }
+    // The globals are one card: a minor collection only scans them after a young object was stored.
+    if (!heap.isMinorCollection() || globalsDirty) {
+        for (const auto& [name, value] : globals) {
+            heap.markObject(name);
+            heap.markValue(value);
+        }
+        globalsDirty = false;
+    }
+    for (ObjUpvalue* upvalue : openUpvalues) {
+        heap.markUpvalue(upvalue);
+    }
+    if (script != nullptr) {
+        heap.markChunk(script->chunk);
+    }
 }
+
 void vMachine::closeUpvalues(Value* last)
 {
-    while (openUpvalues != nullptr && openUpvalues->location >= last) {
-        ObjUpvalue* upvalue = openUpvalues;
+    while (!openUpvalues.empty() && openUpvalues.back()->location >= last) {
+        ObjUpvalue* upvalue = openUpvalues.back();
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
-        openUpvalues = upvalue->next;
+        if (Heap::needsBarrier(upvalue->closed)) {
+            Heap::instance().rememberUpvalue(upvalue);
+        }
+        openUpvalues.pop_back();
+    }
+}
+
+void vMachine::setUpvalue(ObjUpvalue* upvalue, const Value& value)
+{
+    *upvalue->location = value;
+    if (Heap::needsBarrier(value)) {
+        Heap::instance().rememberUpvalue(upvalue);
     }
 }
 
@@ -98,264 +194,596 @@ void vMachine::execute()
     auto main = frames.back();
     frames.clear();
     frames.push_back(main);
-    ip() = 0;
+    ip() = instructions().code.data();
     run();
 }
 
-CallFrame& vMachine::frame()
+ObjUpvalue* vMachine::captureUpvalue(Value* local)
 {
-    return frames.back();
+    // `local` belongs to the running frame, so this stops within its upvalues, usually at once.
+    size_t position = openUpvalues.size();
+    while (position > 0 && openUpvalues[position - 1]->location > local) {
+        position--;
+    }
+    if (position > 0 && openUpvalues[position - 1]->location == local) {
+        return openUpvalues[position - 1];
+    }
+    auto* createdUpvalue = Heap::instance().allocateUpvalue(local);
+    openUpvalues.insert(openUpvalues.begin() + static_cast<ptrdiff_t>(position), createdUpvalue);
+    return createdUpvalue;
 }
 
-size_t vMachine::offset()
+void vMachine::run()
 {
-    return frame().stackOffset;
+    // Ahead-of-time compiled scripts come with native code for the script body too.
+    if (currentFunction()->jitCode) {
+        Jit::enter(*this);
+        return;
+    }
+    bool switchLoop = true;
+    while (switchLoop) {
+        switchLoop = currentFunction()->isVerified ? interpret<true>() : interpret<false>();
+    }
 }
 
-ObjUpvalue* vMachine::captureUpvalue(Value* local)
-{
+#if defined(VM_COMPUTED_GOTO) && (defined(__GNUC__) || defined(__clang__))
+#define VM_THREADED_DISPATCH
+#endif
 
-    ObjUpvalue* prevUpvalue = nullptr;
-    ObjUpvalue* upvalue = this->openUpvalues;
-    while (upvalue != nullptr && upvalue->location > local) {
-        prevUpvalue = upvalue;
-        upvalue = upvalue->next;
-    }
+// The loop keeps the active frame's state in locals; it is written back to the frame
+// only when control leaves the frame (calls, returns, errors, tracing).
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, static_cast<int16_t>((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define READ_CONSTANT_LONG() (ip += 3, constants[ip[-3] | (ip[-2] << 8) | (ip[-1] << 16)])
+#define SAVE_FRAME() (frame->ip = ip)
+#define LOAD_FRAME()                                                               \
+    do {                                                                           \
+        frame = &frames.back();                                                    \
+        ip = frame->ip;                                                            \
+        chunk = &frame->closure->pFunction->chunk;                                 \
+        constants = chunk->pool.data();                                            \
+        codeEnd = chunk->code.data() + chunk->code.size();                         \
+        slots = stack.data() + frame->stackOffset;                                 \
+    } while (false)
 
-    if (upvalue != nullptr && upvalue->location == local) {
-        return upvalue;
-    }
-    auto* createdUpvalue = new ObjUpvalue { local };
+// Verified frames had their peak depth checked on entry; unverified ones push at most one value per instruction.
+#define CHECK_HEADROOM()                                                           \
+    do {                                                                           \
+        if (!Verified && !stack.hasRoom(1)) {                                      \
+            SAVE_FRAME();                                                          \
+            runtimeError(vError::StackOverflow, "Stack overflow.");                \
+            return false;                                                          \
+        }                                                                          \
+    } while (false)
+
+// Verified code is known not to underflow; unverified code checks before popping.
+#define REQUIRE_STACK(count, opcode)                                               \
+    do {                                                                           \
+        if (!Verified && stack.size() < (count)) {                                 \
+            SAVE_FRAME();                                                          \
+            runtimeError(vError::StackUnderflow,                                   \
+                std::format("Stack underflow occurred during {} operation", opcode)); \
+            return false;                                                          \
+        }                                                                          \
+    } while (false)
+
+// Verified code had these operands bounded at the parent's CLOSURE; unverified code checks them here.
+#define REQUIRE_ENCLOSING_LOCAL(slot)                                              \
+    do {                                                                           \
+        if (!Verified && (frame == frames.data() || (frame - 1)->stackOffset + (slot) >= frame->stackOffset)) { \
+            SAVE_FRAME();                                                          \
+            runtimeError(vError::InvalidLocal,                                     \
+                std::format("Attempt to access invalid enclosing local at slot {}", slot)); \
+            return false;                                                          \
+        }                                                                          \
+    } while (false)
+#define REQUIRE_ENCLOSING_UPVALUE(slot)                                            \
+    do {                                                                           \
+        if (!Verified && (frame == frames.data() || (slot) >= (frame - 1)->closure->upValues.size())) { \
+            SAVE_FRAME();                                                          \
+            runtimeError(vError::InvalidLocal,                                     \
+                std::format("Attempt to access invalid enclosing upvalue at slot {}", slot)); \
+            return false;                                                          \
+        }                                                                          \
+    } while (false)
 
-    createdUpvalue->next = upvalue;
+// Number-number operands are handled inline; anything else goes to the out-of-line slow path.
+#define NUMBER_BINARY_OP(op, slowPath)                                             \
+    do {                                                                           \
+        Value& a = stack.end()[-2];                                                \
+        const Value& b = stack.back();                                             \
+        if (a.isNumber() && b.isNumber()) {                                        \
+            a = Value(a.asNumberUnchecked() op b.asNumberUnchecked());             \
+            stack.pop_back();                                                      \
+        } else {                                                                   \
+            SAVE_FRAME();                                                          \
+            if (!(slowPath)) {                                                     \
+                return false;                                                      \
+            }                                                                      \
+        }                                                                          \
+    } while (false)
 
-    if (prevUpvalue == nullptr) {
-        openUpvalues = createdUpvalue;
-    } else {
-        prevUpvalue->next = createdUpvalue;
+// Calls the callee under `argCount` arguments; `site` is the instruction's address, which keys its inline cache.
+#define CALL_VALUE(argCount, site)                                                 \
+    do {                                                                           \
+        SAVE_FRAME();                                                              \
+        const size_t depth = frames.size();                                        \
+        if (!callCached(stack.end()[-1 - (argCount)], (argCount), chunk->cacheAt((site) - chunk->code.data()))) { \
+            return false;                                                          \
+        }                                                                          \
+        if (frames.size() > depth && frames.back().closure->pFunction->jitCode) {            \
+            if (!Jit::enter(*this)) {                                              \
+                return false;                                                      \
+            }                                                                      \
+        } else if (currentFunction()->isVerified != Verified) {                    \
+            return true;                                                           \
+        }                                                                          \
+        LOAD_FRAME();                                                              \
+    } while (false)
+
+// A MATH_* opcode that vMachine::intrinsic cannot compute makes an ordinary call instead.
+#define MATH_INTRINSIC(opcode, argCount)                                            \
+    do {                                                                           \
+        REQUIRE_STACK((argCount) + 1, "MATH");                                     \
+        if (intrinsic(opcode, stack.end() - (argCount))) {                         \
+            stack.resize(stack.size() - (argCount));                               \
+            break;                                                                 \
+        }                                                                          \
+        CALL_VALUE(argCount, ip - 1);                                              \
+    } while (false)
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_INSTRUCTION() (SAVE_FRAME(), traceInstruction())
+#else
+#define TRACE_INSTRUCTION() ((void)0)
+#endif
+
+// Opcode bodies are shared by both dispatch strategies: VM_CASE names a body and VM_NEXT
+// ends it, either by jumping straight to the next body or by returning to the switch.
+#ifdef VM_THREADED_DISPATCH
+#define VM_CASE(op) op_##op
+#define VM_NEXT()                                                                  \
+    do {                                                                           \
+        if constexpr (SingleStep) {                                                \
+            SAVE_FRAME();                                                          \
+            return true;                                                           \
+        }                                                                          \
+        VM_DISPATCH();                                                             \
+    } while (false)
+#define VM_DISPATCH()                                                              \
+    do {                                                                           \
+        if (!Verified && ip >= codeEnd) {                                          \
+            SAVE_FRAME();                                                          \
+            return false;                                                          \
+        }                                                                          \
+        TRACE_INSTRUCTION();                                                       \
+        byte = READ_BYTE();                                                        \
+        CHECK_HEADROOM();                                                          \
+        if (!Verified && byte >= OP_CODE_COUNT) {                                  \
+            goto op_UNKNOWN;                                                       \
+        }                                                                          \
+        goto* dispatchTable[byte];                                                 \
+    } while (false)
+#else
+#define VM_CASE(op) case cast(OP_CODE::op)
+#define VM_NEXT() break
+#endif
+
+void vMachine::traceInstruction()
+{
+#ifdef DEBUG_TRACE_EXECUTION
+    std::cout << "          ";
+    for (const auto& value : stack) {
+        std::cout << "[ ";
+        value.print();
+        std::cout << " ]";
     }
-    return createdUpvalue;
+    std::cout << "\n";
+    instructions().disassembleInstruction(ip() - instructions().code.data());
+#endif
 }
 
-void vMachine::run()
+// Runs until the script finishes, an error stops it, or the active frame needs the other loop (returns true).
+// With SingleStep it executes the one instruction at the frame's ip and returns true unless it failed;
+// the JIT uses this for opcodes it has no template for, so it must not be used for CALL or RETURN.
+template <bool Verified, bool SingleStep>
+bool vMachine::interpret()
 {
-    try {
-        while (ip() < instructions().code.size()) {
-            uint8_t byte = readByte();
-#ifdef DEBUG_TRACE_EXECUTION
-            std::cout << "          ";
-            for (const auto& value : stack) {
-                std::cout << "[ ";
-                value.print();
-                std::cout << " ]";
-            }
-            std::cout << "\n";
-            instructions().disassembleInstruction(ip() - 1);
+    uint8_t byte;
+    CallFrame* frame;
+    const uint8_t* ip;
+    Chunk* chunk;
+    const Value* constants;
+    const uint8_t* codeEnd;
+    Value* slots;
+    LOAD_FRAME();
+#ifdef VM_THREADED_DISPATCH
+    // Indexed by opcode value, so the order must follow OP_CODE exactly.
+    static void* dispatchTable[] = {
+        &&op_ADD, &&op_MULT, &&op_PRINT, &&op_LESS_EQUAL, &&op_GREATER_EQUAL,
+        &&op_DEFINE_GLOBAL, &&op_SET_GLOBAL, &&op_POP, &&op_SWAP, &&op_DUP,
+        &&op_DIV, &&op_NEG, &&op_NIL, &&op_TRUE, &&op_FALSE,
+        &&op_CONSTANT, &&op_CONSTANT_LONG, &&op_EQUAL, &&op_GREATER, &&op_LESS,
+        &&op_NOT, &&op_RETURN, &&op_GET_GLOBAL, &&op_GET_LOCAL, &&op_SET_LOCAL,
+        &&op_JUMP_IF_FALSE, &&op_JUMP, &&op_LOOP, &&op_CALL, &&op_CLOSURE,
+        &&op_GET_UPVALUE, &&op_SET_UPVALUE, &&op_CLOSE_UPVALUE, &&op_GET_ENCLOSING_LOCAL, &&op_SET_ENCLOSING_LOCAL,
+        &&op_GET_ENCLOSING_UPVALUE, &&op_SET_ENCLOSING_UPVALUE, &&op_MATH_SQRT, &&op_MATH_ABS, &&op_MATH_FLOOR,
+        &&op_MATH_CEIL, &&op_MATH_ROUND, &&op_MATH_POW
+    };
+    static_assert(std::size(dispatchTable) == OP_CODE_COUNT, "dispatch table out of sync with OP_CODE");
+
+    VM_DISPATCH();
+    {
+#else
+    // Verified code always ends in RETURN, so only the checked loop guards against running off the end.
+    while (Verified || ip < codeEnd) {
+        TRACE_INSTRUCTION();
+        byte = READ_BYTE();
+        CHECK_HEADROOM();
+        switch (byte) {
 #endif
-            switch (byte) {
-            case cast(OP_CODE::CALL): {
-                int argCount = readByte();
-                if (!callValue(stack[stack.size() - 1 - argCount - offset()], argCount)) {
-                    return;
-                }
-                break;
+        VM_CASE(CALL): {
+            int argCount = READ_BYTE();
+            CALL_VALUE(argCount, ip - 2);
+            VM_NEXT();
+        }
+        VM_CASE(MATH_SQRT):
+            MATH_INTRINSIC(OP_CODE::MATH_SQRT, 1);
+            VM_NEXT();
+        VM_CASE(MATH_ABS):
+            MATH_INTRINSIC(OP_CODE::MATH_ABS, 1);
+            VM_NEXT();
+        VM_CASE(MATH_FLOOR):
+            MATH_INTRINSIC(OP_CODE::MATH_FLOOR, 1);
+            VM_NEXT();
+        VM_CASE(MATH_CEIL):
+            MATH_INTRINSIC(OP_CODE::MATH_CEIL, 1);
+            VM_NEXT();
+        VM_CASE(MATH_ROUND):
+            MATH_INTRINSIC(OP_CODE::MATH_ROUND, 1);
+            VM_NEXT();
+        VM_CASE(MATH_POW):
+            MATH_INTRINSIC(OP_CODE::MATH_POW, 2);
+            VM_NEXT();
+        VM_CASE(CLOSURE): {
+            const Value constant = READ_CONSTANT();
+            if (!Verified && !(constant.isObj() && constant.asObj()->is<ObjFunction>())) {
+                SAVE_FRAME();
+                runtimeError(vError::TypeError, "CLOSURE operand is not a function");
+                return false;
             }
-            case cast(OP_CODE::CLOSURE): {
-                Value funcAsValue = readConstant();
-                auto function = funcAsValue.asFunc();
-                auto closure = new ObjClosure { function };
-                for (int i = 0; i < function->upValueCount; i++) {
-                    uint8_t isLocal = readByte();
-                    uint8_t index = readByte();
-                    if (isLocal) {
-                        closure->upValues.emplace_back(captureUpvalue(&stack[offset() + index]));
-                    } else {
-                        closure->upValues.emplace_back(frames.back().closure->upValues[index]);
-                    }
+            auto function = constant.asFunc();
+            ObjClosure* closure = Heap::instance().allocateClosure(function);
+            // On the stack first, so capturing (which allocates) cannot collect it.
+            stack.emplace_back(closure);
+            for (ObjUpvalue*& upvalue : closure->upValues) {
+                uint8_t isLocal = READ_BYTE();
+                uint8_t index = READ_BYTE();
+                if (isLocal) {
+                    upvalue = captureUpvalue(slots + index);
+                } else {
+                    upvalue = frame->closure->upValues[index];
                 }
-                stack.emplace_back(new Obj { *closure });
-                break;
-            }
-            case cast(OP_CODE::GET_UPVALUE): {
-                uint8_t slot = readByte();
-                stack.emplace_back(frames.back().closure->upValues[slot]->location);
-                break;
             }
-            case cast(OP_CODE::SET_UPVALUE): {
-                uint8_t slot = readByte();
-                frames.back().closure->upValues[slot]->location = &stack.back();
-                break;
+            VM_NEXT();
+        }
+        VM_CASE(GET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            stack.push_back(*frame->closure->upValues[slot]->location);
+            VM_NEXT();
+        }
+        VM_CASE(SET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            setUpvalue(frame->closure->upValues[slot], stack.back());
+            VM_NEXT();
+        }
+        VM_CASE(GET_ENCLOSING_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            REQUIRE_ENCLOSING_LOCAL(slot);
+            stack.push_back(stack[(frame - 1)->stackOffset + slot]);
+            VM_NEXT();
+        }
+        VM_CASE(SET_ENCLOSING_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            REQUIRE_ENCLOSING_LOCAL(slot);
+            stack[(frame - 1)->stackOffset + slot] = stack.back();
+            VM_NEXT();
+        }
+        VM_CASE(GET_ENCLOSING_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            REQUIRE_ENCLOSING_UPVALUE(slot);
+            stack.push_back(*(frame - 1)->closure->upValues[slot]->location);
+            VM_NEXT();
+        }
+        VM_CASE(SET_ENCLOSING_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            REQUIRE_ENCLOSING_UPVALUE(slot);
+            setUpvalue((frame - 1)->closure->upValues[slot], stack.back());
+            VM_NEXT();
+        }
+        VM_CASE(NIL): {
+            stack.emplace_back(Value { nullptr });
+            VM_NEXT();
+        }
+        VM_CASE(RETURN): {
+            popFrame();
+            if (frames.size() == returnDepth) {
+                return false;
             }
-            case cast(OP_CODE::NIL): {
-                stack.emplace_back(Value { nullptr });
-                break;
+            if (currentFunction()->isVerified != Verified) {
+                return true;
             }
-            case cast(OP_CODE::RETURN): {
-                Value result = stack.back();
-                stack.resize(frames.back().stackOffset - 1);
-                closeUpvalues(&stack[frames.back().stackOffset - 1]);
-                frames.pop_back();
-                if (frames.size() == 1) {
-                    stack.push_back(result);
-                    return;
+            LOAD_FRAME();
+            VM_NEXT();
+        }
+        VM_CASE(LOOP): {
+            const size_t at = ip - 1 - chunk->code.data();
+            uint16_t offset = READ_SHORT();
+            ip -= offset;
+            // Single steps come from the trace recorder itself, so they never count.
+            if constexpr (Verified && !SingleStep) {
+                if (jitEnabled) {
+                    InlineCache& cache = chunk->cacheAt(at);
+                    if (cache.trace || (!cache.traceAborted && ++cache.hotness == Jit::LOOP_THRESHOLD)) {
+                        SAVE_FRAME();
+                        if (!Jit::backEdge(*this, cache)) {
+                            return false;
+                        }
+                        ip = frame->ip;
+                    }
                 }
-                stack.push_back(result);
-                break;
             }
-
-            case cast(OP_CODE::LOOP): {
-                uint16_t offset = readShort();
-                ip() -= offset;
-            } break;
-            case cast(OP_CODE::CONSTANT): {
-                Value constant = readConstant();
-                stack.push_back(constant);
-            } break;
-            case cast(OP_CODE::CONSTANT_LONG): {
-                Value constant = readConstantLong();
-                stack.push_back(constant);
-            } break;
-            case cast(OP_CODE::TRUE):
-                stack.emplace_back(true);
-                break;
-            case cast(OP_CODE::FALSE):
-                stack.emplace_back(false);
-                break;
-            case cast(OP_CODE::ADD):
-                ensureStackSize(2, "ADD");
-                add();
-                break;
-            case cast(OP_CODE::MULT):
-                ensureStackSize(2, "MULTIPLY");
-                mult();
-                break;
-            case cast(OP_CODE::DIV):
-                ensureStackSize(2, "DIVIDE");
+            VM_NEXT();
+        }
+        VM_CASE(CONSTANT): {
+            stack.push_back(READ_CONSTANT());
+            VM_NEXT();
+        }
+        VM_CASE(CONSTANT_LONG): {
+            stack.push_back(READ_CONSTANT_LONG());
+            VM_NEXT();
+        }
+        VM_CASE(TRUE):
+            stack.emplace_back(true);
+            VM_NEXT();
+        VM_CASE(FALSE):
+            stack.emplace_back(false);
+            VM_NEXT();
+        VM_CASE(ADD):
+            REQUIRE_STACK(2, "ADD");
+            NUMBER_BINARY_OP(+, add());
+            VM_NEXT();
+        VM_CASE(MULT):
+            REQUIRE_STACK(2, "MULTIPLY");
+            NUMBER_BINARY_OP(*, mult());
+            VM_NEXT();
+        VM_CASE(DIV): {
+            REQUIRE_STACK(2, "DIVIDE");
+            Value& a = stack.end()[-2];
+            const Value& b = stack.back();
+            if (a.isNumber() && b.isNumber() && b.asNumberUnchecked() != 0) {
+                a = Value(a.asNumberUnchecked() / b.asNumberUnchecked());
+                stack.pop_back();
+            } else {
+                SAVE_FRAME();
                 div();
-                break;
-            case cast(OP_CODE::NEG):
-                ensureStackSize(1, "NEGATE");
+                return false;
+            }
+            VM_NEXT();
+        }
+        VM_CASE(NEG):
+            REQUIRE_STACK(1, "NEGATE");
+            if (stack.back().isNumber()) {
+                stack.back() = Value(-stack.back().asNumberUnchecked());
+            } else {
+                SAVE_FRAME();
                 neg();
-                break;
-            case cast(OP_CODE::PRINT):
-                ensureStackSize(1, "PRINT");
-                stack.back().print();
-                std::cout << std::endl;
-                break;
-            case cast(OP_CODE::POP):
-                stack.pop_back();
-                break;
-            case cast(OP_CODE::DEFINE_GLOBAL): {
-                auto name = readConstant();
-                auto value = stack.back();
-                if (auto internedString = StringInterner::instance().find(name.to_string()); !internedString) {
-                    std::cerr << "Failed to intern string: " << name.to_string() << std::endl;
-                } else {
-                    if (globals.contains(*internedString)) {
-                        runtimeError(std::format("Cannot redefine previously defined variable {}", *internedString));
-                    }
-                    globals[*internedString] = value;
-                    stack.pop_back();
-                }
-            } break;
-            case cast(OP_CODE::SET_GLOBAL): {
-                auto name = readConstant();
-                globals[name.to_string()] = stack.back();
-                break;
+                return false;
             }
-            case cast(OP_CODE::GET_GLOBAL): {
-                auto name = readConstant();
-                auto it = globals.find(name.to_string());
-                if (it == globals.end()) {
-                    runtimeError(std::format("wUndefined variable {}.", name.to_string()));
-                }
-                stack.push_back(it->second);
-            } break;
-            case cast(OP_CODE::GET_LOCAL): {
-                uint8_t slot = readByte();
-                size_t index = offset() + slot;
-#ifdef DEBUG_TRACE_EXECUTION
-                std::cout << "Getting local variable at slot " << static_cast<int>(slot)
-                          << " (stack index " << index << ")" << std::endl;
-#endif
-                if (index >= stack.size()) {
-                    runtimeError(std::format("Attempt to access invalid local variable at slot {}", slot));
-                    return;
-                }
-                stack.push_back(stack[index]);
-            } break;
-            case cast(OP_CODE::SET_LOCAL): {
-                uint8_t slot = readByte();
-                stack[offset() + slot] = stack.back();
-            } break;
-            case cast(OP_CODE::NOT):
-                ensureStackSize(1, "LOGICAL_NOT");
-                logicalNot();
-                break;
-            case cast(OP_CODE::GREATER):
-                ensureStackSize(2, "GREATER");
-                greater();
-                break;
-            case cast(OP_CODE::GREATER_EQUAL):
-                ensureStackSize(2, "GREATER_EQUAL");
-                greaterEqual();
-                break;
-            case cast(OP_CODE::LESS):
-                ensureStackSize(2, "LESS");
-                less();
-                break;
-            case cast(OP_CODE::LESS_EQUAL):
-                ensureStackSize(2, "LESS");
-                lessEqual();
-                break;
-            case cast(OP_CODE::EQUAL):
-                ensureStackSize(2, "EQUAL");
-                equal();
-                break;
-            case cast(OP_CODE::CLOSE_UPVALUE):
-                closeUpvalues(&stack.back());
-                stack.pop_back();
-                break;
-            case cast(OP_CODE::JUMP_IF_FALSE): {
-                ensureStackSize(1, "JUMP_IF_FALSE");
-                int offset = readShort();
-                if (!stack.back().isTruthy()) {
-                    ip() += offset;
-                }
-                break;
+            VM_NEXT();
+        VM_CASE(PRINT):
+            REQUIRE_STACK(1, "PRINT");
+            stack.back().print();
+            std::cout << std::endl;
+            VM_NEXT();
+        VM_CASE(POP):
+            stack.pop_back();
+            VM_NEXT();
+        VM_CASE(DEFINE_GLOBAL): {
+            ObjString* name = &READ_CONSTANT().asObj()->as<ObjString>();
+            auto value = stack.back();
+            if (globals.contains(name)) {
+                SAVE_FRAME();
+                runtimeError(vError::Redefinition, std::format("Cannot redefine previously defined variable {}", name->view()));
+                return false;
             }
-            case cast(OP_CODE::JUMP): {
-                int offset = readShort();
-                ip() += offset;
-                break;
+            globals[name] = value;
+            globalsVersion = newGlobalsVersion();
+            globalsDirty |= Heap::isYoung(value) || !name->old;
+            stack.pop_back();
+            VM_NEXT();
+        }
+        VM_CASE(SET_GLOBAL): {
+            InlineCache& cache = chunk->cacheAt(ip - 1 - chunk->code.data());
+            auto name = READ_CONSTANT();
+            globalsDirty |= Heap::isYoung(stack.back());
+            if (cache.version == globalsVersion) {
+                *cache.cell = stack.back();
+                VM_NEXT();
             }
-            case cast(OP_CODE::SWAP): {
-                swap();
-                break;
+            const size_t globalCount = globals.size();
+            Value& cell = globals[&name.asObj()->as<ObjString>()];
+            cell = stack.back();
+            if (globals.size() != globalCount) {
+                globalsVersion = newGlobalsVersion();
             }
-            case cast(OP_CODE::DUP): {
-                dup();
-                break;
+            cache.version = globalsVersion;
+            cache.cell = &cell;
+            VM_NEXT();
+        }
+        VM_CASE(GET_GLOBAL): {
+            InlineCache& cache = chunk->cacheAt(ip - 1 - chunk->code.data());
+            auto name = READ_CONSTANT();
+            if (cache.version == globalsVersion) {
+                stack.push_back(*cache.cell);
+                VM_NEXT();
+            }
+            auto it = globals.find(&name.asObj()->as<ObjString>());
+            if (it == globals.end()) {
+                SAVE_FRAME();
+                runtimeError(vError::UndefinedVariable, std::format("Undefined variable {}.", name.to_string()));
+                return false;
             }
-            default:
-                throw std::runtime_error(std::format("Unknown opcode: {}", static_cast<int>(byte)));
+            // unordered_map nodes never move, so the cell stays valid until the table changes shape.
+            cache.version = globalsVersion;
+            cache.cell = &it->second;
+            stack.push_back(it->second);
+            VM_NEXT();
+        }
+        VM_CASE(GET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+#ifdef DEBUG_TRACE_EXECUTION
+            std::cout << "Getting local variable at slot " << static_cast<int>(slot)
+                      << " (stack index " << frame->stackOffset + slot << ")" << std::endl;
+#endif
+            if (!Verified && frame->stackOffset + slot >= stack.size()) {
+                SAVE_FRAME();
+                runtimeError(vError::InvalidLocal, std::format("Attempt to access invalid local variable at slot {}", slot));
+                return false;
             }
+            stack.push_back(slots[slot]);
+            VM_NEXT();
+        }
+        VM_CASE(SET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            slots[slot] = stack.back();
+            VM_NEXT();
         }
-    } catch (const StackUnderflowError& e) {
-        std::cerr << std::format("Runtime Error: {}\n", e.what());
-        state = vState::BAD;
-        stack.clear();
-    } catch (const std::exception& e) {
-        std::cerr << std::format("Runtime Error: {}\n", e.what());
-        state = vState::BAD;
+        VM_CASE(NOT):
+            REQUIRE_STACK(1, "LOGICAL_NOT");
+            logicalNot();
+            VM_NEXT();
+        VM_CASE(GREATER):
+            REQUIRE_STACK(2, "GREATER");
+            NUMBER_BINARY_OP(>, operandError("Invalid operation: can only compare numbers"));
+            VM_NEXT();
+        VM_CASE(GREATER_EQUAL):
+            REQUIRE_STACK(2, "GREATER_EQUAL");
+            NUMBER_BINARY_OP(>=, operandError("Invalid operation: can only compare numbers"));
+            VM_NEXT();
+        VM_CASE(LESS):
+            REQUIRE_STACK(2, "LESS");
+            NUMBER_BINARY_OP(<, operandError("Invalid operation: can only compare numbers"));
+            VM_NEXT();
+        VM_CASE(LESS_EQUAL):
+            REQUIRE_STACK(2, "LESS_EQUAL");
+            NUMBER_BINARY_OP(<=, operandError("Invalid operation: can only compare numbers"));
+            VM_NEXT();
+        VM_CASE(EQUAL): {
+            REQUIRE_STACK(2, "EQUAL");
+            Value& a = stack.end()[-2];
+            const Value& b = stack.back();
+            if (a.isNumber() && b.isNumber()) {
+                a = Value(a.asNumberUnchecked() == b.asNumberUnchecked());
+                stack.pop_back();
+            } else {
+                equal();
+            }
+            VM_NEXT();
+        }
+        VM_CASE(CLOSE_UPVALUE):
+            closeUpvalues(&stack.back());
+            stack.pop_back();
+            VM_NEXT();
+        VM_CASE(JUMP_IF_FALSE): {
+            REQUIRE_STACK(1, "JUMP_IF_FALSE");
+            int offset = READ_SHORT();
+            if (!stack.back().isTruthy()) {
+                ip += offset;
+            }
+            VM_NEXT();
+        }
+        VM_CASE(JUMP): {
+            int offset = READ_SHORT();
+            ip += offset;
+            VM_NEXT();
+        }
+        VM_CASE(SWAP): {
+            swap();
+            VM_NEXT();
+        }
+        VM_CASE(DUP): {
+            dup();
+            VM_NEXT();
+        }
+#ifdef VM_THREADED_DISPATCH
+    op_UNKNOWN:
+        SAVE_FRAME();
+        runtimeError(vError::UnknownOpcode, std::format("Unknown opcode: {}", static_cast<int>(byte)));
+        return false;
     }
+#else
+        default:
+            SAVE_FRAME();
+            runtimeError(vError::UnknownOpcode, std::format("Unknown opcode: {}", static_cast<int>(byte)));
+            return false;
+        }
+        if constexpr (SingleStep) {
+            SAVE_FRAME();
+            return true;
+        }
+    }
+    SAVE_FRAME();
+#endif
+    return false;
+}
+
+#undef VM_CASE
+#undef VM_NEXT
+#undef VM_DISPATCH
+#undef TRACE_INSTRUCTION
+#undef CHECK_HEADROOM
+#undef MATH_INTRINSIC
+#undef CALL_VALUE
+#undef NUMBER_BINARY_OP
+#undef REQUIRE_ENCLOSING_UPVALUE
+#undef REQUIRE_ENCLOSING_LOCAL
+#undef REQUIRE_STACK
+#undef LOAD_FRAME
+#undef SAVE_FRAME
+#undef READ_CONSTANT_LONG
+#undef READ_CONSTANT
+#undef READ_SHORT
+#undef READ_BYTE
+
+bool vMachine::operandError(const char* message)
+{
+    runtimeError(vError::TypeError, message);
+    return false;
+}
+
+// The characters `value` contributes to a concatenation.
+static size_t concatenatedLength(const Value& value)
+{
+    return value.isString() ? stringLength(*value.asObj()) : std::format("{:.6g}", value.asNumberUnchecked()).size();
 }
 
-void vMachine::add()
+bool vMachine::add()
 {
-    const auto b = stack.back();
+    const Value& a = stack.end()[-2];
+    const Value& b = stack.back();
+    const bool stringOperand = a.isString() || b.isString();
+    if (!((a.isNumber() || a.isString()) && (b.isNumber() || b.isString())) || (!stringOperand && !a.isNumber())) {
+        return operandError("Invalid operation: can only add numbers or concatenate strings");
+    }
+    if (stringOperand && concatenatedLength(a) + concatenatedLength(b) > MAX_STRING_LENGTH) {
+        return operandError("String too long");
+    }
+    // Both operands stay on the stack, where the collector sees them, until the result is made.
+    stack.end()[-2] = a + b;
     stack.pop_back();
-    stack.back() += b;
+    return true;
 }
 
 void vMachine::swap()
@@ -368,18 +796,37 @@ void vMachine::swap()
     stack.push_back(next);
 }
 
-void vMachine::mult()
+bool vMachine::mult()
 {
-    const auto& right = stack.back();
+    const Value& a = stack.end()[-2];
+    const Value& b = stack.back();
+    const Value* count = a.isString() && b.isNumber() ? &b : b.isString() && a.isNumber() ? &a : nullptr;
+    if (count == nullptr) {
+        return operandError("Invalid operation: can only multiply numbers or string by number");
+    }
+    const double times = count->asNumberUnchecked();
+    if (times < 0) {
+        return operandError("Cannot multiply string by negative number");
+    }
+    if (!std::isfinite(times) || times != std::floor(times)) {
+        return operandError("Can only multiply string by a whole number");
+    }
+    const uint32_t length = stringLength(*(count == &a ? b : a).asObj());
+    if (times > static_cast<double>(MAX_STRING_LENGTH / std::max<size_t>(length, 1))) {
+        return operandError("String too long");
+    }
+    stack.end()[-2] = a * b;
     stack.pop_back();
-    stack.back() *= right;
+    return true;
 }
 
-void vMachine::div()
+bool vMachine::div()
 {
-    const auto& right = stack.back();
-    stack.pop_back();
-    stack.back() /= right;
+    if (!stack.end()[-2].isNumber() || !stack.back().isNumber()) {
+        return operandError("Invalid operation: can only divide numbers");
+    }
+    runtimeError(vError::DivisionByZero, "Division by zero");
+    return false;
 }
 
 void vMachine::dup()
@@ -387,14 +834,16 @@ void vMachine::dup()
     stack.push_back(stack.back());
 }
 
-void vMachine::neg()
+bool vMachine::neg()
 {
-    stack.back() = -stack.back();
+    return operandError("Invalid operation: can only negate numbers");
 }
 
 void vMachine::resetStack()
 {
     stack.clear();
+    frames.clear();
+    openUpvalues.clear();
 }
 
 void vMachine::logicalNot()
@@ -402,123 +851,176 @@ void vMachine::logicalNot()
     stack.back() = !stack.back();
 }
 
-void vMachine::greater()
+void vMachine::equal()
 {
-    const auto b = stack.back();
+    // Comparing ropes flattens them, so both stay on the stack meanwhile.
+    stack.end()[-2] = stack.end()[-2] == stack.back();
     stack.pop_back();
-    const auto& a = stack.back();
-    stack.back() = a > b;
 }
 
-void vMachine::less()
+bool vMachine::ensureCompiled(ObjFunction& function)
 {
-    const auto b = stack.back();
-    stack.pop_back();
-    const auto& a = stack.back();
-    stack.back() = a < b;
+    if (function.declaration == nullptr) {
+        return true;
+    }
+    if (!ByteCompiler::compileDeferred(function)) {
+        runtimeError(vError::CompileError, std::format("Failed to compile function {}.", function.name));
+        return false;
+    }
+    Verifier::verify(function);
+    return true;
 }
 
-void vMachine::equal()
+bool vMachine::callCached(const Value callee, const int argCount, InlineCache& cache)
 {
-    const auto b = stack.back();
-    stack.pop_back();
-    const auto& a = stack.back();
-    stack.back() = a == b;
+    if (callee.isObj() && callee.asObj() == cache.callee) {
+        // Monomorphic hit: the callee's kind and arity are already known.
+        if (cache.closure != nullptr) {
+            return argCount == cache.arity ? pushFrame(cache.closure, argCount) : call(cache.closure, argCount);
+        }
+        return callNative(*cache.native, argCount);
+    }
+    return callValue(callee, argCount, cache);
 }
 
-void vMachine::greaterEqual()
+void vMachine::popFrame()
 {
-    const auto b = stack.back();
-    stack.pop_back();
-    const auto& a = stack.back();
-    stack.back() = !(a < b);
+    const Value result = stack.back();
+    const size_t base = frames.back().stackOffset;
+    // Most frames capture nothing.
+    if (!openUpvalues.empty() && openUpvalues.back()->location >= &stack[base]) {
+        closeUpvalues(&stack[base]);
+    }
+    frames.pop_back();
+    stack.resize(base);
+    if (!frames.empty()) {
+        stack.push_back(result);
+    }
 }
 
-void vMachine::lessEqual()
+bool vMachine::runCallee()
 {
-    const auto b = stack.back();
-    stack.pop_back();
-    const auto& a = stack.back();
-    stack.back() = !(a > b);
+    if (frames.back().closure->pFunction->jitCode) {
+        return Jit::enter(*this);
+    }
+    const size_t outer = returnDepth;
+    returnDepth = frames.size() - 1;
+    run();
+    returnDepth = outer;
+    return state == vState::OK;
 }
 
-void vMachine::call(ObjFunction* function, int argCount)
+bool vMachine::step(const uint8_t* ip)
 {
-    if (argCount != function->arity) {
-        runtimeError(std::format("Function expected {} arguments but got {}.", function->arity, argCount));
-        return;
-    }
-    if (frames.size() == FRAMES_MAX) {
-        runtimeError("Stack overflow.");
-        return;
-    }
+    frames.back().ip = ip;
+    return interpret<true, true>();
+}
 
-    CallFrame callFrame {
-        function,
-        0,
-        stack.size() - argCount - 1,
-        nullptr
-    };
-    frames.push_back(callFrame);
+void vMachine::setJitEnabled(const bool enabled)
+{
+    jitEnabled = enabled && Jit::available;
 }
 
-void vMachine::call(ObjClosure* closure, int argCount)
+bool vMachine::call(ObjClosure* closure, int argCount)
 {
     if (argCount != closure->pFunction->arity) {
-        runtimeError(std::format("Closure expected {} arguments but got {}.", closure->pFunction->arity, argCount));
-        return;
+        runtimeError(vError::ArityMismatch, std::format("Closure expected {} arguments but got {}.", closure->pFunction->arity, argCount));
+        return false;
+    }
+    if (!ensureCompiled(*closure->pFunction)) {
+        return false;
     }
+    return pushFrame(closure, argCount);
+}
+
+bool vMachine::pushFrame(ObjClosure* closure, const int argCount)
+{
     if (frames.size() == FRAMES_MAX) {
-        runtimeError("Stack overflow.");
-        return;
+        runtimeError(vError::StackOverflow, "Stack overflow.");
+        return false;
+    }
+    ObjFunction* function = closure->pFunction;
+    if (jitEnabled && !function->jitCode && ++function->callCount == Jit::CALL_THRESHOLD) {
+        Jit::compile(*this, *function);
+    }
+    // Verified callees know their peak depth, so this one check covers every push the frame makes.
+    const size_t base = stack.size() - argCount - 1;
+    if (base + closure->pFunction->maxStackDepth > stack.capacity()) {
+        runtimeError(vError::StackOverflow, "Stack overflow.");
+        return false;
     }
 
     CallFrame callFrame {
-        nullptr,
-        0,
-        stack.size() - argCount - 1,
-        closure
+        closure,
+        closure->pFunction->chunk.code.data(),
+        base
     };
     frames.push_back(callFrame);
+    return true;
 }
 
-void vMachine::load(ObjFunction* mainFunction)
+bool vMachine::callNative(ObjNative& native, const int argCount)
 {
+    if (native.arity >= 0 && argCount != native.arity) {
+        runtimeError(vError::ArityMismatch, std::format("Native expected {} arguments but got {}.", native.arity, argCount));
+        return false;
+    }
+    Value* args = stack.end() - argCount;
+    native.function(argCount, args, args[-1]);
+    stack.resize(stack.size() - argCount);
+    return true;
+}
 
-    frames.emplace_back(CallFrame { nullptr, 0, 0, new ObjClosure { mainFunction } });
+void vMachine::load(ObjFunction* mainFunction)
+{
+    Verifier::verify(*mainFunction);
+    script = mainFunction;
+    ObjClosure* main = Heap::instance().allocateClosure(mainFunction);
+    stack.emplace_back(main);
+    frames.emplace_back(CallFrame { main, mainFunction->chunk.code.data(), 0 });
     defineNativeFunctions();
 }
 
-bool vMachine::callValue(Value callee, int argCount)
+// Fills a CALL cache. The chunk holding it may be older than the callee, or already marked, hence the write barrier.
+static void cacheCallee(InlineCache& cache, Obj* callee, ObjClosure* closure, ObjNative* native, const int arity)
 {
-    return std::visit(overloaded {
-                          [this, argCount](Obj* obj) -> bool {
-                              return std::visit(overloaded {
-                                                    [this, argCount](ObjFunction& func) -> bool {
-                                                        call(&func, argCount);
-                                                        return true;
-                                                    },
+    cache.callee = callee;
+    cache.closure = closure;
+    cache.native = native;
+    cache.arity = arity;
+    if (Heap::needsBarrier(callee)) {
+        Heap::instance().rememberCache(cache);
+    }
+}
 
-                                                    [this, argCount](ObjClosure& cloj) -> bool {
-                                                        call(&cloj, argCount);
-                                                        return true;
+bool vMachine::callValue(Value callee, int argCount, InlineCache& cache)
+{
+    return callee.visit(overloaded {
+                          [this, argCount, &cache](Obj* obj) -> bool {
+                              return obj->visit(overloaded {
+                                                    [this, argCount, &cache, obj](ObjFunction& func) -> bool {
+                                                        if (func.bareClosure == nullptr) {
+                                                            func.bareClosure = Heap::instance().allocateClosure(&func);
+                                                            Heap::instance().rememberFunction(func);
+                                                        }
+                                                        cacheCallee(cache, obj, &func.bareClosure->as<ObjClosure>(), nullptr, func.arity);
+                                                        return call(cache.closure, argCount);
+                                                    },
+                                                    [this, argCount, &cache, obj](ObjClosure& cloj) -> bool {
+                                                        cacheCallee(cache, obj, &cloj, nullptr, cloj.pFunction->arity);
+                                                        return call(&cloj, argCount);
                                                     },
-                                                    [this, argCount](ObjNative& native) -> bool {
-                                                        const Value result = native.function(argCount, &stack[stack.size() - argCount]);
-                                                        stack.pop_back();
-                                                        stack.pop_back();
-                                                        stack.push_back(result);
-                                                        return true;
+                                                    [this, argCount, &cache, obj](ObjNative& native) -> bool {
+                                                        cacheCallee(cache, obj, nullptr, &native, -1);
+                                                        return callNative(native, argCount);
                                                     },
                                                     [this](const auto&) -> bool {
-                                                        runtimeError("Can only call functions and classes.");
+                                                        runtimeError(vError::NotCallable, "Can only call functions and classes.");
                                                         return false;
-                                                    } },
-                                  obj->as);
+                                                    } });
                           },
                           [this](const auto& b) -> bool {
-                              runtimeError("Cannot call a non Object");
+                              runtimeError(vError::NotCallable, "Cannot call a non Object");
                               return false;
-                          } },
-        callee.as);
+                          } });
 }